@@ -0,0 +1,146 @@
+#include <stdatomic.h>
+#include <gtk/gtk.h>
+
+#include "engine.h"
+#include "telemetry.h"
+#include "activity.h"
+
+#define ACTIVITY_HEIGHT 128
+#define ACTIVITY_SECONDS 4
+/* Notes kept for drawing; the oldest are forgotten first. */
+#define ACTIVITY_BARS 2048
+
+/* A note as it sounded: from start to end, or still on if open. */
+struct bar
+{
+    uint32_t start;
+    uint32_t end;
+    uint8_t port;
+    uint8_t channel;
+    uint8_t note;
+    uint8_t velocity;
+    uint8_t open;
+};
+
+static struct bar bars[ACTIVITY_BARS];
+static int next_bar;
+/* Index of the open bar for each port, channel and note, or -1. The same
+ * note can be on in several channels at once, layered by zones. */
+static int open_bars[MAX_INSTANCES][16][128];
+static long dropped;
+
+static const double port_colors[MAX_INSTANCES][3] = {
+    {0.85, 0.20, 0.15}, {0.15, 0.45, 0.85}, {0.20, 0.65, 0.25}, {0.85, 0.60, 0.10}, 
+    {0.55, 0.25, 0.75}, {0.10, 0.65, 0.65}, {0.80, 0.30, 0.55}, {0.45, 0.45, 0.45}
+};
+
+static void
+close_bar(int port, int channel, int note, uint32_t time)
+{
+    int i = open_bars[port][channel][note];
+    if (i >= 0) {
+        bars[i].end = time;
+        bars[i].open = 0;
+        open_bars[port][channel][note] = -1;
+    }
+}
+
+static void
+open_bar(int port, int channel, int note, int velocity, uint32_t time)
+{
+    close_bar(port, channel, note, time);
+    struct bar *bar = &bars[next_bar];
+    if (bar->open) {
+        open_bars[bar->port][bar->channel][bar->note] = -1;
+    }
+    *bar = (struct bar) { time, time, port, channel, note, velocity, 1 };
+    open_bars[port][channel][note] = next_bar;
+    next_bar = (next_bar + 1) % ACTIVITY_BARS;
+}
+
+/* Drain everything process_cb sent since the last frame. */
+static gboolean
+activity_tick_cb(GtkWidget *widget, GdkFrameClock *frame_clock, gpointer user_data)
+{
+    struct telemetry_event event;
+    int any = 0;
+    while (telemetry_read(&telemetry, &event)) {
+        int status = event.data[0] & 0xf0;
+        int channel = event.data[0] & 0x0f;
+        if (event.port >= MAX_INSTANCES || event.data[1] > 127) {
+            continue;
+        }
+        if (status == 0x90 && event.data[2]) {
+            open_bar(event.port, channel, event.data[1], event.data[2], event.time);
+        } else if (status == 0x80 || status == 0x90) {
+            close_bar(event.port, channel, event.data[1], event.time);
+        }
+        any = 1;
+    }
+    if (telemetry.dropped != dropped) {
+        /* Note-offs may be among what was lost, so nothing can be trusted
+         * to still be on. */
+        dropped = telemetry.dropped;
+        for (int port=0; port<MAX_INSTANCES; port++) {
+            for (int channel=0; channel<16; channel++) {
+                for (int note=0; note<128; note++) {
+                    close_bar(port, channel, note, atomic_load(&telemetry.now));
+                }
+            }
+        }
+    }
+    if (any || telemetry.rate) {
+        gtk_widget_queue_draw(widget);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static void
+activity_draw_cb(GtkDrawingArea *drawing_area, cairo_t *cr, int width, int height,
+                 gpointer data)
+{
+    cairo_set_source_rgb(cr, 0.1, 0.1, 0.1);
+    cairo_paint(cr);
+    if (!telemetry.rate) {
+        return;
+    }
+    uint32_t now = atomic_load(&telemetry.now);
+    double span = (double) telemetry.rate * ACTIVITY_SECONDS;
+    double row = (double) height / 128;
+    for (int i=0; i<ACTIVITY_BARS; i++) {
+        struct bar *bar = &bars[i];
+        if (!bar->velocity) {
+            continue;
+        }
+        /* Unsigned differences, so frame time wrapping around is fine. */
+        uint32_t end_age = bar->open ? 0 : now - bar->end;
+        uint32_t start_age = now - bar->start;
+        if (end_age > span) {
+            continue;
+        }
+        double x0 = width - start_age / span * width;
+        double x1 = width - end_age / span * width;
+        const double *color = port_colors[bar->port];
+        double shade = 0.4 + 0.6 * bar->velocity / 127;
+        cairo_set_source_rgb(cr, color[0]*shade, color[1]*shade, color[2]*shade);
+        cairo_rectangle(cr, x0, (127 - bar->note) * row, MAX(x1 - x0, 1), MAX(row, 1));
+        cairo_fill(cr);
+    }
+}
+
+GtkWidget *
+activity_strip_new(void)
+{
+    for (int port=0; port<MAX_INSTANCES; port++) {
+        for (int channel=0; channel<16; channel++) {
+            for (int note=0; note<128; note++) {
+                open_bars[port][channel][note] = -1;
+            }
+        }
+    }
+    GtkWidget *strip = gtk_drawing_area_new();
+    gtk_widget_set_size_request(strip, -1, ACTIVITY_HEIGHT);
+    gtk_drawing_area_set_draw_func(GTK_DRAWING_AREA(strip), activity_draw_cb, NULL, NULL);
+    gtk_widget_add_tick_callback(strip, activity_tick_cb, NULL, NULL);
+    return strip;
+}
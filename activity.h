@@ -0,0 +1,8 @@
+#ifndef __ACTIVITY_H__
+#define __ACTIVITY_H__
+
+/* A scrolling piano roll of the midi that actually went out, drawn from 
+ * telemetry once per frame. */
+GtkWidget *activity_strip_new(void);
+
+#endif
@@ -0,0 +1,143 @@
+#include <string.h>
+#include <gtk/gtk.h>
+
+#include "interface.h"
+#include "engine.h"
+#include "library.h"
+#include "browser.h"
+
+/* Rows shown at most; the status line still counts every match. */
+#define BROWSER_RESULTS 200
+
+enum search_mode { SEARCH_NAME, SEARCH_CONTAINS, SEARCH_INTERVALS };
+
+static const char *mode_names[] = {"Name", "Contains notes", "Intervals", NULL};
+static const char *note_names[12] = {"C", "C#", "D", "Eb", "E", "F", "F#", "G", 
+    "Ab", "A", "Bb", "B"};
+
+static GtkWidget *browser_window;
+static GtkWidget *mode_dropdown;
+static GtkWidget *search_entry;
+static GtkWidget *status_label;
+static GtkWidget *result_list;
+static int results[BROWSER_RESULTS];
+static int num_results;
+
+static GtkWidget *
+result_row_new(const struct library_chord *chord)
+{
+    char text[256];
+    int used = snprintf(text, sizeof(text), "%s", chord->name);
+    if (chord->canonical[0] && strcmp(chord->canonical, chord->name)) {
+        used += snprintf(text + used, sizeof(text) - used, " (%s)", chord->canonical);
+    }
+    used += snprintf(text + used, sizeof(text) - used, "  —");
+    for (int i=0; chord->notes[i] != CHTERM && used < (int) sizeof(text); i++) {
+        used += snprintf(text + used, sizeof(text) - used, " %s", 
+                         note_names[((chord->notes[i] % 12) + 12) % 12]);
+    }
+    GtkWidget *label = gtk_label_new(text);
+    gtk_label_set_xalign(GTK_LABEL(label), 0);
+    return label;
+}
+
+static void
+search_cb(GtkSearchEntry *entry, gpointer user_data)
+{
+    const char *text = gtk_editable_get_text(GTK_EDITABLE(search_entry));
+    int mode = gtk_drop_down_get_selected(GTK_DROP_DOWN(mode_dropdown));
+    gint64 start = g_get_monotonic_time();
+    int found = 0;
+    if (mode == SEARCH_NAME) {
+        found = library_find_name(text, results, BROWSER_RESULTS);
+    } else if (mode == SEARCH_CONTAINS) {
+        uint16_t pitch_classes = library_parse_pitch_classes(text);
+        if (pitch_classes) {
+            found = library_find_pitch_classes(pitch_classes, results, BROWSER_RESULTS);
+        }
+    } else {
+        uint16_t shape = library_parse_shape(text);
+        if (shape) {
+            found = library_find_shape(shape, results, BROWSER_RESULTS);
+        }
+    }
+    gint64 elapsed = g_get_monotonic_time() - start;
+    num_results = found < BROWSER_RESULTS ? found : BROWSER_RESULTS;
+
+    gtk_list_box_remove_all(GTK_LIST_BOX(result_list));
+    for (int i=0; i<num_results; i++) {
+        gtk_list_box_append(GTK_LIST_BOX(result_list), result_row_new(&library[results[i]]));
+    }
+    char status[96];
+    snprintf(status, sizeof(status), "%d of %d chords (%.2f ms)", found, 
+             library_size, elapsed / 1000.0);
+    gtk_label_set_text(GTK_LABEL(status_label), status);
+}
+
+static void
+mode_changed_cb(GObject *dropdown, GParamSpec *pspec, gpointer user_data)
+{
+    search_cb(NULL, NULL);
+}
+
+static void
+row_activated_cb(GtkListBox *list, GtkListBoxRow *row, gpointer user_data)
+{
+    int i = gtk_list_box_row_get_index(row);
+    if (i >= 0 && i < num_results) {
+        const struct library_chord *chord = &library[results[i]];
+        show_changes(engine_assign_chord(active->current_chord, chord->notes, chord->name));
+    }
+}
+
+static void
+build_browser(GtkWindow *parent)
+{
+    browser_window = gtk_window_new();
+    gtk_window_set_title(GTK_WINDOW(browser_window), "Chord Library");
+    gtk_window_set_transient_for(GTK_WINDOW(browser_window), parent);
+    gtk_window_set_default_size(GTK_WINDOW(browser_window), 420, 500);
+    gtk_window_set_hide_on_close(GTK_WINDOW(browser_window), 1);
+
+    GtkWidget *box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+    gtk_widget_set_margin_top(box, 5);
+    gtk_widget_set_margin_bottom(box, 5);
+    gtk_widget_set_margin_start(box, 5);
+    gtk_widget_set_margin_end(box, 5);
+
+    GtkWidget *search_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    mode_dropdown = gtk_drop_down_new_from_strings(mode_names);
+    g_signal_connect(mode_dropdown, "notify::selected", G_CALLBACK(mode_changed_cb), NULL);
+    gtk_box_append(GTK_BOX(search_box), mode_dropdown);
+    search_entry = gtk_search_entry_new();
+    gtk_widget_set_hexpand(search_entry, 1);
+    gtk_widget_set_tooltip_text(search_entry, 
+        "A name, notes such as \"E B\", or semitones above the bass such as \"4 7 11\"");
+    g_signal_connect(search_entry, "search-changed", G_CALLBACK(search_cb), NULL);
+    gtk_box_append(GTK_BOX(search_box), search_entry);
+    gtk_box_append(GTK_BOX(box), search_box);
+
+    status_label = gtk_label_new(NULL);
+    gtk_label_set_xalign(GTK_LABEL(status_label), 0);
+    gtk_box_append(GTK_BOX(box), status_label);
+
+    result_list = gtk_list_box_new();
+    g_signal_connect(result_list, "row-activated", G_CALLBACK(row_activated_cb), NULL);
+    GtkWidget *scrolled = gtk_scrolled_window_new();
+    gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(scrolled), result_list);
+    gtk_widget_set_vexpand(scrolled, 1);
+    gtk_box_append(GTK_BOX(box), scrolled);
+
+    gtk_window_set_child(GTK_WINDOW(browser_window), box);
+}
+
+void
+browser_show(GtkWindow *parent)
+{
+    if (!browser_window) {
+        build_browser(parent);
+    }
+    /* Pick up whatever was recorded or loaded since last time. */
+    search_cb(NULL, NULL);
+    gtk_window_present(GTK_WINDOW(browser_window));
+}
@@ -0,0 +1,8 @@
+#ifndef __BROWSER_H__
+#define __BROWSER_H__
+
+/* The chord library window. Searching shows matching chords; activating 
+ * one, by clicking it or pressing Enter, puts it in the current slot. */
+void browser_show(GtkWindow *parent);
+
+#endif
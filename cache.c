@@ -0,0 +1,129 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "engine.h"
+#include "cache.h"
+#include "tables.h"
+
+#define CACHE_FRESH 4
+
+struct cache_buffers *
+cache_new(void)
+{
+    struct cache_buffers *buf = calloc(1, sizeof(struct cache_buffers));
+    atomic_init(&buf->middle, 1);
+    buf->back = 2;
+    buf->front = 0;
+    return buf;
+}
+
+/* Write the packets for one entry, starting at packets[n], and return the
+ * index after the last one. */
+static int
+build_entry(struct packet_cache *cache, int n, int *notes, int inversion, 
+            int root_note, int velocity, int channel)
+{
+    int voiced[MAX_CHORD_LEN+1];
+    if (!notes) {
+        return n;
+    }
+    copy_chord(voiced, notes);
+    for (int i=0; i<inversion; i++) {
+        invert_up(voiced);
+    }
+    for (int i=0; i>inversion; i--) {
+        invert_down(voiced);
+    }
+    for (int *nt = voiced; *nt != CHTERM; nt++) {
+        int note = root_note + *nt;
+        /* Drop notes midi can't express rather than letting them wrap. */
+        if (note < 0 || note > 127) {
+            continue;
+        }
+        cache->packets[n][0] = 0x90 | channel;
+        cache->packets[n][1] = note;
+        cache->packets[n][2] = velocity;
+        n++;
+    }
+    return n;
+}
+
+/* The in-scale chord for the note pkey plays, as a CHTERM-terminated list. */
+static void
+diatonic_chord_for_key(const struct lkey_instance *inst, int pkey, int *chord)
+{
+    int pc = (inst->base_note + pkey) % 12;
+    int sevenths = inst->harmony == HARMONY_SEVENTHS;
+    const struct diatonic_chord *dc = 
+        &diatonic_chords[sevenths][inst->scale_root][inst->scale_mode][pc];
+    for (int i=0; i<dc->len; i++) {
+        chord[i] = dc->intervals[i];
+    }
+    chord[dc->len] = CHTERM;
+}
+
+/* Rebuild every entry from inst's chord bank and zones and publish the 
+ * result. Runs on the GTK thread whenever a chord, the octave, the velocity,
+ * the scale or a zone changes. Keys outside a zone, and chords a zone can't 
+ * play, get empty entries. */
+void 
+cache_rebuild(struct cache_buffers *buf, const struct lkey_instance *inst)
+{
+    struct packet_cache *cache = &buf->caches[buf->back];
+    int e = 0;
+    int n = 0;
+    for (int pkey=0; pkey<NUM_KEYS; pkey++) {
+        cache->routes[pkey] = 0;
+    }
+    for (int z=0; z<MAX_ZONES; z++) {
+        const struct zone *zone = &inst->zones[z];
+        int velocity = zone->velocity ? zone->velocity : inst->volume;
+        /* A note-on with velocity 0 is a note-off. */
+        if (velocity < 1) {
+            velocity = 1;
+        }
+        cache->zone_chord[z] = zone->chord;
+        cache->zone_channel[z] = zone->channel;
+        for (int pkey=zone->low; zone->enabled && pkey<=zone->high; pkey++) {
+            cache->routes[pkey] |= 1 << z;
+        }
+        for (int c=0; c<NUM_CACHE_CHORDS; c++) {
+            int used = zone->enabled && (zone->chord == ZONE_FOLLOW || zone->chord == c);
+            for (int inv=-MAX_INVERSION; inv<=MAX_INVERSION; inv++) {
+                /* A zone on a fixed slot plays it uninverted. */
+                int built = used && (zone->chord == ZONE_FOLLOW || inv == 0);
+                for (int pkey=0; pkey<NUM_KEYS; pkey++, e++) {
+                    int diatonic[5];
+                    int *notes = diatonic;
+                    if (c == DIATONIC_CHORD) {
+                        diatonic_chord_for_key(inst, pkey, diatonic);
+                    } else {
+                        notes = inst->chords_array[c];
+                    }
+                    cache->offsets[e] = n;
+                    if (built && (cache->routes[pkey] & (1 << z))) {
+                        n = build_entry(cache, n, notes, inv, 
+                                        inst->base_note + 12*zone->octave + pkey, 
+                                        velocity, zone->channel);
+                    }
+                }
+            }
+        }
+    }
+    cache->offsets[e] = n;
+    int old = atomic_exchange_explicit(&buf->middle, buf->back | CACHE_FRESH, 
+                                       memory_order_acq_rel);
+    buf->back = old & ~CACHE_FRESH;
+}
+
+/* Called once per cycle by process_cb: picks up the newest published cache. */
+const struct packet_cache *
+cache_acquire(struct cache_buffers *buf)
+{
+    if (atomic_load_explicit(&buf->middle, memory_order_relaxed) & CACHE_FRESH) {
+        int old = atomic_exchange_explicit(&buf->middle, buf->front, 
+                                           memory_order_acq_rel);
+        buf->front = old & ~CACHE_FRESH;
+    }
+    return &buf->caches[buf->front];
+}
@@ -0,0 +1,50 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdint.h>
+
+#include "engine.h"
+
+/* Inversions run from -MAX_INVERSION to MAX_INVERSION. */
+#define MAX_INVERSION 3
+#define NUM_INVERSIONS (2*MAX_INVERSION + 1)
+#define ZONE_CACHE_ENTRIES (NUM_CACHE_CHORDS*NUM_INVERSIONS*NUM_KEYS)
+#define NUM_CACHE_ENTRIES (MAX_ZONES*ZONE_CACHE_ENTRIES)
+
+/* Ready-to-send midi packets for every (zone, chord, inversion, key). The 
+ * packets for entry e are packets[offsets[e]] up to packets[offsets[e+1]].
+ * routes[pkey] has bit z set if zone z plays pkey, and the zone_ arrays are
+ * the zones' chord (or ZONE_FOLLOW) and channel as of the rebuild, so 
+ * process_cb routes a key without looking at the zones themselves. */
+struct packet_cache
+{
+    uint16_t offsets[NUM_CACHE_ENTRIES + 1];
+    uint8_t packets[NUM_CACHE_ENTRIES*MAX_CHORD_LEN][3];
+    uint8_t routes[NUM_KEYS];
+    int8_t zone_chord[MAX_ZONES];
+    uint8_t zone_channel[MAX_ZONES];
+};
+
+static inline int 
+cache_entry(int zone, int chord, int inversion, int pkey)
+{
+    return ((zone*NUM_CACHE_CHORDS + chord)*NUM_INVERSIONS + inversion + MAX_INVERSION)
+        *NUM_KEYS + pkey;
+}
+
+/* The cache is triple buffered: the GTK thread fills caches[back] and swaps 
+ * it into the middle slot, and process_cb swaps the middle slot with its 
+ * front buffer whenever the middle one is fresh. Neither side ever waits. */
+struct cache_buffers
+{
+    struct packet_cache caches[3];
+    _Atomic int middle;
+    int back;
+    int front;
+};
+
+struct cache_buffers *cache_new(void);
+void cache_rebuild(struct cache_buffers *buf, const struct lkey_instance *inst);
+const struct packet_cache *cache_acquire(struct cache_buffers *buf);
+
+#endif
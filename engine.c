@@ -0,0 +1,1391 @@
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine.h"
+#include "cache.h"
+#include "library.h"
+#include "replay.h"
+
+#define BASE_NOTE 60
+#define DEFAULT_CHORDS 5
+
+#define VELOCITY 127
+#define NOTE_OFF_VELOCITY 64
+
+#define DEBUG 1
+
+/* GLOBAL VARS */
+
+int chord_unity[2] = {0, CHTERM};
+int chord_major_triad[4] = {0, 4, 7, CHTERM};
+int chord_minor_triad[4] = {0, 3, 7, CHTERM}; 
+int chord_dim_triad[4] = {0, 3, 6, CHTERM};
+int chord_aug_triad[10] = {0, 4, 8, CHTERM};
+int *default_chords[DEFAULT_CHORDS] = {chord_unity, chord_major_triad,
+                            chord_minor_triad, chord_dim_triad, chord_aug_triad};
+char *default_chord_names[DEFAULT_CHORDS] = {"No Chord", "Major", "Minor", 
+                            "Diminished", "Augmented"};
+
+struct lkey_instance instances[MAX_INSTANCES];
+int num_instances = 1;
+struct lkey_instance *active = &instances[0];
+int editing = 0;
+int editing_i = 0;
+/* Instance each physical key was pressed on, so a release reaches the same
+ * keyboard even if the user switched in between. */
+struct lkey_instance *key_owner[NUM_KEYS];
+struct lkey_instance *sustain_owner;
+
+uint8_t note_keycodes[NUM_KEYS] = { 52, 39, 53, 40, 54, 55, 42, 56, 43, 57, 44, 58, 59, 46, 60, 47, 61}; 
+uint8_t keypad_keycodes[10] = {90, 87, 88, 89, 83, 84, 85, 79, 80, 81};
+
+int debug_enabled = DEBUG;
+
+void debug(char *format, ...) {
+#if DEBUG
+    if (!debug_enabled) {
+        return;
+    }
+    va_list args;
+    va_start(args, format );
+    vfprintf(stderr, format, args );
+    va_end(args);
+#endif
+}
+
+/* Publish the key state written so far, and ask process_cb to send midi for pkey. */
+static void mark_key_pending(struct lkey_instance *inst, int pkey)
+{
+    atomic_fetch_or_explicit(&inst->key_pending[pkey/64], (uint64_t) 1 << (pkey%64), 
+                             memory_order_release);
+}
+
+/* Ask process_cb to pick up a sustain, latch or panic change. */
+static void mark_controls_pending(struct lkey_instance *inst)
+{
+    atomic_store_explicit(&inst->controls_pending, 1, memory_order_release);
+}
+
+static void set_latch(struct lkey_instance *inst, int on)
+{
+    atomic_store_explicit(&inst->latch, on, memory_order_relaxed);
+    mark_controls_pending(inst);
+}
+
+/* Silence everything inst has sounding. */
+static void panic(struct lkey_instance *inst)
+{
+    atomic_store_explicit(&inst->panic, 1, memory_order_relaxed);
+    mark_controls_pending(inst);
+}
+
+static uint32_t
+pack_expression(int bend, int amount, int vertical, int smooth)
+{
+    return bend | amount << 14 | vertical << 21 | (uint32_t) smooth << 23;
+}
+
+static uint32_t
+pack_key(int chord, int inversion, int pressed, int strikes)
+{
+    return chord | (uint8_t) inversion << 8 | pressed << 16 | 
+        (uint32_t) (uint8_t) strikes << 24;
+}
+
+/* Call after changing a chord, the octave, the velocity or the harmony. */
+void update_packet_cache(struct lkey_instance *inst)
+{
+    cache_rebuild(inst->cache, inst);
+}
+
+/* The chord a key pressed now would play. */
+static int played_chord(struct lkey_instance *inst)
+{
+    return inst->harmony == HARMONY_SLOTS ? inst->current_chord : DIATONIC_CHORD;
+}
+
+/* Point chords_array and chord_names at the current page's slots; needed
+ * whenever the bank moves. */
+static void 
+point_at_page(struct lkey_instance *inst)
+{
+    inst->chords_array = inst->bank_chords + inst->page*NUM_CHORDS;
+    inst->chord_names = inst->bank_names + inst->page*NUM_CHORDS;
+}
+
+/* Grow the bank by one page of empty slots. */
+static void 
+add_page(struct lkey_instance *inst)
+{
+    int slots = (inst->num_pages + 1)*NUM_CHORDS;
+    inst->bank_chords = realloc(inst->bank_chords, slots*sizeof(int *));
+    inst->bank_names = realloc(inst->bank_names, slots*sizeof(char *));
+    inst->bank_inversions = realloc(inst->bank_inversions, slots*sizeof(int));
+    inst->bank_recorded = realloc(inst->bank_recorded, slots*sizeof(int));
+    for (int i=inst->num_pages*NUM_CHORDS; i<slots; i++) {
+        inst->bank_chords[i] = NULL;
+        inst->bank_names[i] = NULL;
+        inst->bank_inversions[i] = 0;
+        inst->bank_recorded[i] = -1;
+    }
+    inst->num_pages++;
+    point_at_page(inst);
+}
+
+/* Switch inst to another page of its bank. The current chord keeps its slot
+ * number; held keys follow in live mode like after any chord change. */
+static void 
+show_page(struct lkey_instance *inst, int page)
+{
+    for (int i=0; i<NUM_CHORDS; i++) {
+        inst->bank_inversions[inst->page*NUM_CHORDS + i] = inst->chord_inversion[i];
+        inst->chord_inversion[i] = inst->bank_inversions[page*NUM_CHORDS + i];
+    }
+    inst->page = page;
+    point_at_page(inst);
+    update_packet_cache(inst);
+    update_held_keys(inst);
+}
+
+/* Give inst the default chord bank. We want dynamically allocated chords in 
+ * its chords_array. */
+void init_instance(struct lkey_instance *inst) 
+{
+    for (int i=0; i<NUM_KEYS; i++ ) {
+        atomic_init(&inst->keys.state[i], 0);
+        inst->keys.taken[i] = 0;
+        inst->keys.struck[i] = 0;
+        for (int z=0; z<MAX_ZONES; z++) {
+            inst->keys.voice_mask[i][z] = (noteset_t) {{0, 0}};
+            inst->keys.voice_channel[i][z] = 0;
+        }
+        inst->key_delay[i] = 0;
+        inst->key_due[i] = 0;
+        inst->key_waiting[i] = 0;
+    }
+    atomic_init(&inst->sustain_key, 0);
+    atomic_init(&inst->latch, 0);
+    atomic_init(&inst->panic, 0);
+    atomic_init(&inst->controls_pending, 0);
+    atomic_init(&inst->quantize, QUANTIZE_OFF);
+    atomic_init(&inst->swing, 50);
+    for (int i=0; i<MAX_STEPS; i++) {
+        atomic_init(&inst->progression[i], 0);
+    }
+    atomic_init(&inst->num_steps, 0);
+    atomic_init(&inst->progression_seq, 0);
+    atomic_init(&inst->sequencing, 0);
+    atomic_init(&inst->seq_tempo, DEFAULT_SEQ_TEMPO);
+    atomic_init(&inst->seq_position, -1);
+    inst->seq_num_steps = 0;
+    inst->seq_copied = 0;
+    inst->seq_step = -1;
+    inst->seq_chord = 0;
+    inst->seq_inversion = 0;
+    inst->seq_beat = 0;
+    atomic_init(&inst->expression, pack_expression(BEND_CENTRE, 0, VERTICAL_MODULATION, 0));
+    inst->sent_expression = atomic_load(&inst->expression);
+    inst->frame = 0;
+    inst->num_scheduled = 0;
+    inst->midi_sustain = 0;
+    inst->midi_changed = 0;
+    inst->holding = 0;
+    for (int channel=0; channel<16; channel++) {
+        inst->sounding[channel] = (noteset_t) {{0, 0}};
+        inst->sustained[channel] = (noteset_t) {{0, 0}};
+    }
+    /* One zone over every key, playing the current chord: a plain keyboard. */
+    for (int z=0; z<MAX_ZONES; z++) {
+        inst->zones[z] = (struct zone) { z == 0, 0, NUM_KEYS-1, ZONE_FOLLOW, 0, 0, 0 };
+    }
+    for (int w=0; w<KEY_MASK_WORDS; w++) {
+        atomic_init(&inst->key_pending[w], 0);
+    }
+    inst->bank_chords = NULL;
+    inst->bank_names = NULL;
+    inst->bank_inversions = NULL;
+    inst->bank_recorded = NULL;
+    inst->num_pages = 0;
+    inst->page = 0;
+    add_page(inst);
+    for (int i=0; i<NUM_CACHE_CHORDS; i++) {
+        inst->chord_inversion[i] = 0;
+    }
+    for (int i=0; i<DEFAULT_CHORDS; i++) {
+        int *new_chord = malloc(sizeof(int)*(MAX_CHORD_LEN+1));
+        copy_chord(new_chord, default_chords[i]); 
+        inst->chords_array[i] = new_chord;
+        inst->chord_names[i] = strdup(default_chord_names[i]);
+    }
+    inst->current_chord = 0;
+    inst->volume = VELOCITY;
+    inst->base_note = BASE_NOTE;
+    inst->harmony = HARMONY_SLOTS;
+    inst->scale_root = 0;
+    inst->scale_mode = 0;
+    inst->live_revoice = 0;
+    inst->cache = cache_new();
+    update_packet_cache(inst);
+}
+
+/* NOTE MANIPULATION */
+void invert_down(int *chord) 
+{
+    if (*chord == CHTERM) {
+        return;
+    }
+    int highest=-256;
+    int highest_i=255;
+    int *cur_note = chord;
+    int i = 0;
+    while (*cur_note != CHTERM) {
+        if (*cur_note > highest)  {
+            highest = *cur_note; 
+            highest_i = i;
+        } 
+        i++;
+        cur_note++;
+    }
+    chord[highest_i] -= 12;
+}
+
+void invert_up(int *chord) 
+{
+    if (*chord == CHTERM) {
+        return;
+    }
+    int lowest=256;
+    int lowest_i=255;
+    int *cur_note = chord;
+    int i = 0;
+    while (*cur_note != CHTERM) {
+        if (*cur_note < lowest)  {
+            lowest = *cur_note; 
+            lowest_i = i;
+        } 
+        i++;
+        cur_note++;
+    }
+    chord[lowest_i] += 12;
+}
+
+void copy_chord(int *dest, int *source) 
+{
+    while ((*dest++=*source++)!=CHTERM) {} 
+}
+
+
+/* USER INTERACTION */
+
+static uint8_t get_pkey_by_keycode(unsigned keycode) 
+{
+    for (int i=0; i<NUM_KEYS; i++) {
+        if (keycode == note_keycodes[i]) {
+            return i;
+        }
+    }
+    return 255;
+}
+
+static uint8_t get_keypad_num_by_keycode(unsigned keycode)
+{
+    for (int i=0; i<10; i++) {
+        if (keycode == keypad_keycodes[i]) {
+            return i;
+        }
+    }
+    return 255; 
+}
+
+/* In live mode, move the keys held on inst to whatever they would play if 
+ * pressed now. process_cb sends only the notes that change. Call after
+ * anything that changes what a key plays. */
+void update_held_keys(struct lkey_instance *inst)
+{
+    if (!inst->live_revoice || editing) {
+        return;
+    }
+    int played = played_chord(inst);
+    for (int pkey=0; pkey<NUM_KEYS; pkey++) {
+        if (key_owner[pkey] == inst) {
+            uint32_t old = atomic_load_explicit(&inst->keys.state[pkey], 
+                                                memory_order_relaxed);
+            atomic_store_explicit(&inst->keys.state[pkey], 
+                                  pack_key(played, inst->chord_inversion[played], 
+                                           old >> 16 & 1, old >> 24),
+                                  memory_order_release);
+            mark_key_pending(inst, pkey);
+        }
+    }
+}
+
+/* Make new_chord the chord new presses on inst will play. */
+static int select_chord(struct lkey_instance *inst, int new_chord)
+{
+    inst->current_chord = new_chord;
+    update_held_keys(inst);
+    return UI_CHORD;
+}
+
+/* The arrow keys: select the chord step slots away in the bank's grid, 
+ * turning the page if it is on another. Empty slots can't be selected, as
+ * with the number keys. */
+static int 
+move_in_bank(struct lkey_instance *inst, int step)
+{
+    int slot = inst->page*NUM_CHORDS + inst->current_chord + step;
+    int changes = 0;
+    if (slot < 0 || slot >= inst->num_pages*NUM_CHORDS || !inst->bank_chords[slot]) {
+        return 0;
+    }
+    if (slot / NUM_CHORDS != inst->page) {
+        show_page(inst, slot / NUM_CHORDS);
+        changes = UI_PAGE;
+    }
+    return changes | select_chord(inst, slot % NUM_CHORDS);
+}
+
+static int switch_instance(int n)
+{
+    if (n < 0 || n >= num_instances || editing || &instances[n] == active) {
+        return 0;
+    }
+    active = &instances[n];
+    return UI_INSTANCE;
+}
+
+static int 
+handle_keypress_non_editing_mode(unsigned keyval, unsigned keycode)
+{
+    struct lkey_instance *inst = active;
+    int played = played_chord(inst);
+    int changes = UI_KEYS;
+    uint8_t pkey = get_pkey_by_keycode(keycode);
+    //debug("keyval: %d, keycode: %d\n", keyval, keycode);
+    if (pkey != 255 && key_owner[pkey]==NULL) {
+        uint32_t old = atomic_load_explicit(&inst->keys.state[pkey], 
+                                            memory_order_relaxed);
+        atomic_store_explicit(&inst->keys.state[pkey], 
+                              pack_key(played, inst->chord_inversion[played], 
+                                       1, (old >> 24) + 1),
+                              memory_order_release);
+        key_owner[pkey] = inst;
+        mark_key_pending(inst, pkey);
+    } else if (keycode >= 67 && keycode < 67+MAX_INSTANCES) { // F1-F8
+        changes |= switch_instance(keycode - 67);
+    } else if (keycode == 65) { // space: sustain pedal
+        if (!sustain_owner) {
+            sustain_owner = inst;
+            atomic_store_explicit(&inst->sustain_key, 1, memory_order_relaxed);
+            mark_controls_pending(inst);
+        }
+    } else if (keycode == 23) { // tab: latch
+        set_latch(inst, !atomic_load(&inst->latch));
+        changes |= UI_INSTANCE;
+    } else if (keycode == 9) { // escape
+        panic(inst);
+    } else {
+        uint8_t keypad_num = get_keypad_num_by_keycode(keycode);
+        int new_chord = 255;
+        if (keypad_num != 255) {
+            new_chord = keypad_num; 
+        } else if (keyval >= 48 && keyval < 58) {
+            new_chord = keyval - 48;
+        } else {
+            switch (keycode) { 
+                case 116: //arrow keys
+                changes |= move_in_bank(inst, BANK_COLUMNS);
+                break;
+                case 111:
+                changes |= move_in_bank(inst, -BANK_COLUMNS);
+                break;
+                case 113:
+                changes |= move_in_bank(inst, -1);
+                break;
+                case 114:
+                changes |= move_in_bank(inst, 1);
+                break;
+                case 112: // page up
+                if (inst->page > 0) {
+                    show_page(inst, inst->page - 1);
+                    changes |= UI_PAGE;
+                }
+                break;
+                case 117: // page down
+                if (inst->page < inst->num_pages - 1) {
+                    show_page(inst, inst->page + 1);
+                    changes |= UI_PAGE;
+                }
+                break;
+                case 34: // open bracket
+                if (inst->chord_inversion[played] > -MAX_INVERSION) {
+                    inst->chord_inversion[played]--;
+                    update_held_keys(inst);
+                }
+                break;
+                case 35: // close bracket
+                if (inst->chord_inversion[played] < MAX_INVERSION) {
+                    inst->chord_inversion[played]++;
+                    update_held_keys(inst);
+                }
+                break;
+                case 20: // minus
+                if (inst->base_note >= 12) {
+                    inst->base_note -= 12;
+                    update_packet_cache(inst);
+                    update_held_keys(inst);
+                }
+                break;
+                case 21: // plus
+                if (inst->base_note + 12 + NUM_KEYS-1 <= 127) {
+                    inst->base_note += 12;
+                    update_packet_cache(inst);
+                    update_held_keys(inst);
+                }
+                break;
+            }
+        }
+        if (new_chord != 255 && inst->chords_array[new_chord]) {
+            changes |= select_chord(inst, new_chord);
+        }
+    }
+    return changes;
+}
+
+/* The chord is played in; what's left is for the user to name it. */
+static int 
+leave_editing_mode()
+{
+    active->chords_array[active->current_chord][editing_i] = CHTERM;
+    editing = 2;
+    return UI_NAME_CHORD;
+}
+
+static int 
+handle_keypress_editing_mode(unsigned keyval, unsigned keycode)
+{
+    uint8_t pkey = get_pkey_by_keycode(keycode);
+    if (pkey != 255 && editing==1 && key_owner[pkey]==NULL) {
+        if (editing_i < MAX_CHORD_LEN) {
+            int *chord = active->chords_array[active->current_chord];
+            chord[editing_i] = pkey;      
+            editing_i++;
+            chord[editing_i] = CHTERM;
+            // Don't send midi, because we just want to highlight the key.
+            uint32_t old = atomic_load_explicit(&active->keys.state[pkey], 
+                                                memory_order_relaxed);
+            atomic_store_explicit(&active->keys.state[pkey], old | 1 << 16, 
+                                  memory_order_release);
+            key_owner[pkey] = active;
+            debug("%d\n", editing_i);
+            return UI_KEYS;
+        }
+    } else {
+        if (keycode == 36 || keycode == 104 || keycode==24) {
+            if (editing==1) {
+                return leave_editing_mode();
+            }
+        }
+    }
+    return 0;
+}
+
+int 
+engine_key_pressed(unsigned keyval, unsigned keycode)
+{
+    record_event("press %u %u", keyval, keycode);
+    if (!editing) {
+        return handle_keypress_non_editing_mode(keyval, keycode);
+    } else {
+        return handle_keypress_editing_mode(keyval, keycode);
+    }
+}
+
+int 
+engine_key_released(unsigned keyval, unsigned keycode)
+{
+    record_event("release %u %u", keyval, keycode);
+    uint8_t pkey = get_pkey_by_keycode(keycode);
+    if (pkey != 255 && key_owner[pkey]) {
+        /* Always let process_cb look, even while editing: the key may have 
+         * been sounding before editing started. */
+        struct lkey_instance *inst = key_owner[pkey];
+        uint32_t old = atomic_load_explicit(&inst->keys.state[pkey], 
+                                            memory_order_relaxed);
+        atomic_store_explicit(&inst->keys.state[pkey], old & ~(1u << 16), 
+                              memory_order_release);
+        key_owner[pkey] = NULL;
+        mark_key_pending(inst, pkey);
+    } else if (keycode == 65 && sustain_owner) {
+        atomic_store_explicit(&sustain_owner->sustain_key, 0, memory_order_relaxed);
+        mark_controls_pending(sustain_owner);
+        sustain_owner = NULL;
+    }
+    return UI_KEYS;
+}
+
+int 
+engine_click_chord(int n)
+{
+    record_event("click %d", n);
+    if (!editing && active->chords_array[n]) {
+        return select_chord(active, n);
+    }
+    return 0;
+}
+
+/* Start recording chord n: the next keys pressed are its notes. Does 
+ * nothing while another chord is being recorded or named. */
+int
+engine_edit_chord(int n)
+{
+    if (editing) {
+        return 0;
+    }
+    record_event("edit %d", n);
+    active->current_chord = n;
+    editing = 1;
+    editing_i = 0;
+    int *new_chord = malloc(sizeof(int)*(MAX_CHORD_LEN+1));
+    new_chord[0] = CHTERM;
+    free(active->chords_array[n]);
+    active->chords_array[n] = new_chord;
+    active->chord_inversion[n] = 0;
+    return UI_CHORD;
+}
+
+int
+engine_name_chord(const char *name)
+{
+    if (editing != 2) {
+        return 0;
+    }
+    record_event("name %s", name);
+    editing = 0;
+    free(active->chord_names[active->current_chord]);
+    active->chord_names[active->current_chord] = strdup(name);
+    /* Re-recording a slot updates its chord in the library rather than 
+     * adding one more, so the library doesn't grow with every take. */
+    int *recorded = &active->bank_recorded[active->page*NUM_CHORDS + active->current_chord];
+    if (*recorded >= 0) {
+        library_replace(*recorded, name, active->chords_array[active->current_chord]);
+    } else {
+        *recorded = library_add(name, active->chords_array[active->current_chord]);
+    }
+    update_packet_cache(active);
+    return UI_SLOTS | UI_CHORD;
+}
+
+/* Put a chord, such as one from the library, in slot n. */
+int
+engine_assign_chord(int n, const int *notes, const char *name)
+{
+    char text[MAX_CHORD_LEN*5 + 2];
+    int len = 0, used = 0;
+    for (; len<MAX_CHORD_LEN && notes[len] != CHTERM; len++) {
+        used += snprintf(text + used, sizeof(text) - used, len ? ",%d" : "%d", notes[len]);
+    }
+    record_event("assign %d %s %s", n, len ? text : "-", name);
+    if (editing) {
+        return 0;
+    }
+    int *chord = malloc(sizeof(int)*(MAX_CHORD_LEN+1));
+    memcpy(chord, notes, len*sizeof(int));
+    chord[len] = CHTERM;
+    free(active->chords_array[n]);
+    active->chords_array[n] = chord;
+    free(active->chord_names[n]);
+    active->chord_names[n] = strdup(name);
+    active->chord_inversion[n] = 0;
+    update_packet_cache(active);
+    if (n == active->current_chord) {
+        update_held_keys(active);
+    }
+    return UI_SLOTS;
+}
+
+int 
+engine_set_volume(int volume)
+{
+    if (active->volume != volume) {
+        record_event("volume %d", volume);
+        active->volume = volume;
+        debug("volume: %d\n", active->volume);
+        update_packet_cache(active);
+    }
+    return 0;
+}
+
+int
+engine_set_harmony(int harmony, int root, int mode)
+{
+    struct lkey_instance *inst = active;
+    if (inst->harmony != harmony || inst->scale_root != root || inst->scale_mode != mode) {
+        record_event("harmony %d %d %d", harmony, root, mode);
+        inst->harmony = harmony;
+        inst->scale_root = root;
+        inst->scale_mode = mode;
+        update_packet_cache(inst);
+        update_held_keys(inst);
+    }
+    return 0;
+}
+
+int
+engine_set_latch(int on)
+{
+    if (atomic_load(&active->latch) != on) {
+        record_event("latch %d", on);
+        set_latch(active, on);
+    }
+    return 0;
+}
+
+int
+engine_set_live(int on)
+{
+    if (active->live_revoice != on) {
+        record_event("live %d", on);
+        active->live_revoice = on;
+    }
+    return 0;
+}
+
+/* Zone z covers keys low to high, playing chord slot chord (or ZONE_FOLLOW 
+ * for the current chord) octave octaves up, at velocity (0 for the velocity
+ * slider) on midi channel (0-15). Held keys move to the new routing. */
+int
+engine_set_zone(int z, int enabled, int low, int high, int chord, int octave, 
+                int velocity, int channel)
+{
+    struct lkey_instance *inst = active;
+    if (z < 0 || z >= MAX_ZONES || low < 0 || high >= NUM_KEYS || low > high ||
+        chord < ZONE_FOLLOW || chord >= NUM_CHORDS || octave < -MAX_ZONE_OCTAVE ||
+        octave > MAX_ZONE_OCTAVE || velocity < 0 || velocity > 127 || 
+        channel < 0 || channel > 15) {
+        return 0;
+    }
+    struct zone zone = { enabled, low, high, chord, octave, velocity, channel };
+    if (memcmp(&zone, &inst->zones[z], sizeof(zone)) == 0) {
+        return 0;
+    }
+    record_event("zone %d %d %d %d %d %d %d %d", z, enabled, low, high, chord, 
+                 octave, velocity, channel);
+    inst->zones[z] = zone;
+    update_packet_cache(inst);
+    for (int pkey=0; pkey<NUM_KEYS; pkey++) {
+        if (key_owner[pkey] == inst) {
+            mark_key_pending(inst, pkey);
+        }
+    }
+    return 0;
+}
+
+/* Steps are chord slots with inversions and lengths in beats, rounded to
+ * the nearest quarter beat. A running sequencer picks up the new 
+ * progression at its next cycle. */
+int
+engine_set_progression(const struct progression_step *steps, int num_steps)
+{
+    struct lkey_instance *inst = active;
+    uint32_t packed[MAX_STEPS];
+    char text[MAX_STEPS*16 + 1];
+    int used = 0;
+    if (num_steps < 0 || num_steps > MAX_STEPS) {
+        return 0;
+    }
+    for (int i=0; i<num_steps; i++) {
+        long quarters = steps[i].beats * STEP_QUARTERS + 0.5;
+        if (steps[i].chord < 0 || steps[i].chord >= NUM_CHORDS || 
+            steps[i].inversion < -MAX_INVERSION || steps[i].inversion > MAX_INVERSION ||
+            quarters < 1 || quarters > MAX_STEP_QUARTERS) {
+            return 0;
+        }
+        packed[i] = steps[i].chord | (uint8_t) steps[i].inversion << 8 | 
+            (uint32_t) quarters << 16;
+        used += snprintf(text + used, sizeof(text) - used, " %d:%d:%g", steps[i].chord,
+                         steps[i].inversion, (double) quarters / STEP_QUARTERS);
+    }
+    text[used] = '\0';
+    record_event("progression %d%s", num_steps, text);
+    unsigned seq = atomic_load_explicit(&inst->progression_seq, memory_order_relaxed);
+    atomic_store_explicit(&inst->progression_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (int i=0; i<num_steps; i++) {
+        atomic_store_explicit(&inst->progression[i], packed[i], memory_order_relaxed);
+    }
+    atomic_store_explicit(&inst->num_steps, num_steps, memory_order_relaxed);
+    atomic_store_explicit(&inst->progression_seq, seq + 2, memory_order_release);
+    mark_controls_pending(inst);
+    return 0;
+}
+
+/* Start or stop the sequencer. tempo is only used while transport isn't
+ * rolling; with it rolling the progression follows the song position. */
+int
+engine_set_sequencer(int on, int tempo)
+{
+    struct lkey_instance *inst = active;
+    tempo = tempo < 20 ? 20 : (tempo > 300 ? 300 : tempo);
+    if (atomic_load(&inst->sequencing) == on && atomic_load(&inst->seq_tempo) == tempo) {
+        return 0;
+    }
+    record_event("sequencer %d %d", on, tempo);
+    atomic_store_explicit(&inst->seq_tempo, tempo, memory_order_relaxed);
+    atomic_store_explicit(&inst->sequencing, on, memory_order_relaxed);
+    mark_controls_pending(inst);
+    return 0;
+}
+
+int
+engine_follow_chord(int n, int chord)
+{
+    struct lkey_instance *inst = &instances[n];
+    if (chord == inst->current_chord || editing || !inst->chords_array[chord]) {
+        return 0;
+    }
+    record_event("follow %d %d", n, chord);
+    inst->current_chord = chord;
+    return inst == active ? UI_CHORD : 0;
+}
+
+int
+engine_follow_sequencer(void)
+{
+    int changes = 0;
+    for (int n=0; n<num_instances; n++) {
+        int position = atomic_load_explicit(&instances[n].seq_position, 
+                                            memory_order_relaxed);
+        if (position >= 0) {
+            changes |= engine_follow_chord(n, position & 0xff);
+        }
+    }
+    return changes;
+}
+
+int
+engine_set_expression(int bend, int amount)
+{
+    struct lkey_instance *inst = active;
+    bend = bend < 0 ? 0 : (bend > 0x3fff ? 0x3fff : bend);
+    amount = amount < 0 ? 0 : (amount > 127 ? 127 : amount);
+    uint32_t old = atomic_load_explicit(&inst->expression, memory_order_relaxed);
+    uint32_t new = pack_expression(bend, amount, old >> 21 & 3, old >> 23 & 1);
+    if (new != old) {
+        record_event("expression %d %d", bend, amount);
+        atomic_store_explicit(&inst->expression, new, memory_order_relaxed);
+    }
+    return 0;
+}
+
+int
+engine_set_vertical(int vertical, int smooth)
+{
+    struct lkey_instance *inst = active;
+    if (vertical < VERTICAL_MODULATION || vertical > VERTICAL_PRESSURE) {
+        return 0;
+    }
+    smooth = smooth != 0;
+    uint32_t old = atomic_load_explicit(&inst->expression, memory_order_relaxed);
+    uint32_t new = pack_expression(old & 0x3fff, old >> 14 & 0x7f, vertical, smooth);
+    if (new != old) {
+        record_event("vertical %d %d", vertical, smooth);
+        atomic_store_explicit(&inst->expression, new, memory_order_relaxed);
+    }
+    return 0;
+}
+
+/* Takes effect from the next press. */
+int
+engine_set_quantize(int quantize, int swing)
+{
+    struct lkey_instance *inst = active;
+    if (quantize < QUANTIZE_OFF || quantize > QUANTIZE_16T) {
+        return 0;
+    }
+    swing = swing < 50 ? 50 : (swing > 75 ? 75 : swing);
+    if (atomic_load(&inst->quantize) != quantize || atomic_load(&inst->swing) != swing) {
+        record_event("quantize %d %d", quantize, swing);
+        atomic_store_explicit(&inst->quantize, quantize, memory_order_relaxed);
+        atomic_store_explicit(&inst->swing, swing, memory_order_relaxed);
+    }
+    return 0;
+}
+
+int
+engine_panic(void)
+{
+    record_event("panic");
+    panic(active);
+    return 0;
+}
+
+int
+engine_show_page(int page)
+{
+    struct lkey_instance *inst = active;
+    if (editing || page < 0 || page > inst->num_pages || page >= MAX_PAGES || 
+        page == inst->page) {
+        return 0;
+    }
+    record_event("page %d", page);
+    if (page == inst->num_pages) {
+        add_page(inst);
+    }
+    show_page(inst, page);
+    return UI_PAGE;
+}
+
+/* Show instance n in the window and send it all further key presses. */
+int
+engine_switch_instance(int n)
+{
+    int changes = switch_instance(n);
+    if (changes) {
+        record_event("instance %d", n);
+    }
+    return changes;
+}
+
+/* MIDI OUTPUT */
+
+static void 
+send_note_off(struct midi_sink *sink, uint32_t time, int channel, int note)
+{
+    unsigned char *buffer = sink->reserve(sink->buf, time, 3);
+    if (buffer) {
+        buffer[0] = 0x80 | channel;
+        buffer[1] = note;
+        buffer[2] = NOTE_OFF_VELOCITY;
+    }
+}
+
+/* Send note-offs for every note in notes, all at the same time. */
+static void 
+flush_notes(struct lkey_instance *inst, struct midi_sink *sink, uint32_t time, 
+            int channel, noteset_t notes)
+{
+    int note;
+    while ((note = noteset_pop(&notes)) >= 0) {
+        send_note_off(sink, time, channel, note);
+        noteset_remove(&inst->sounding[channel], note);
+        noteset_remove(&inst->sustained[channel], note);
+    }
+}
+
+/* Flush sets[channel] on every channel; sets is sounding or sustained. */
+static void 
+flush_channels(struct lkey_instance *inst, struct midi_sink *sink, uint32_t time, 
+               noteset_t *sets)
+{
+    for (int channel=0; channel<16; channel++) {
+        if (!noteset_empty(&sets[channel])) {
+            flush_notes(inst, sink, time, channel, sets[channel]);
+        }
+    }
+}
+
+/* Notes in freed are no longer played by their key on channel. Those 
+ * another key or layer still holds there keep sounding; the rest go off, or
+ * are sustained if hold is set. */
+static void 
+free_notes(struct lkey_instance *inst, struct midi_sink *sink, uint32_t time, 
+           int channel, noteset_t freed, int hold)
+{
+    struct key_state *keys = &inst->keys;
+    for (int k=0; k<NUM_KEYS; k++) {
+        for (int z=0; z<MAX_ZONES; z++) {
+            if (keys->voice_channel[k][z] == channel) {
+                freed.w[0] &= ~keys->voice_mask[k][z].w[0];
+                freed.w[1] &= ~keys->voice_mask[k][z].w[1];
+            }
+        }
+    }
+    if (hold) {
+        inst->sustained[channel].w[0] |= freed.w[0];
+        inst->sustained[channel].w[1] |= freed.w[1];
+    } else {
+        flush_notes(inst, sink, time, channel, freed);
+    }
+}
+
+static void 
+release_key(struct lkey_instance *inst, struct midi_sink *sink, uint32_t time, 
+            int pkey, int hold)
+{
+    struct key_state *keys = &inst->keys;
+    for (int z=0; z<MAX_ZONES; z++) {
+        noteset_t freed = keys->voice_mask[pkey][z];
+        if (!noteset_empty(&freed)) {
+            keys->voice_mask[pkey][z] = (noteset_t) {{0, 0}};
+            free_notes(inst, sink, time, keys->voice_channel[pkey][z], freed, hold);
+        }
+    }
+}
+
+/* Make pkey sound its cache entry in each zone that routes it, sending only
+ * the difference from what it has sounding now: notes it keeps are left 
+ * alone. A note that some other key has sounding on the same channel is 
+ * turned off first, so the synth never has more than one of it. */
+static void 
+voice_key(struct lkey_instance *inst, struct midi_sink *sink, uint32_t time, 
+          const struct key_event *event, const struct packet_cache *cache, int hold)
+{
+    struct key_state *keys = &inst->keys;
+    int pkey = event->pkey;
+    for (int z=0; z<MAX_ZONES; z++) {
+        int first = 0, len = 0;
+        if (cache->routes[pkey] & (1 << z)) {
+            int e = cache->zone_chord[z] == ZONE_FOLLOW ? 
+                cache_entry(z, event->chord, event->inversion, pkey) :
+                cache_entry(z, cache->zone_chord[z], 0, pkey);
+            first = cache->offsets[e];
+            len = cache->offsets[e+1] - first;
+        }
+        noteset_t old = keys->voice_mask[pkey][z];
+        noteset_t new = {{0, 0}};
+        for (int i=0; i<len; i++) {
+            noteset_add(&new, cache->packets[first+i][1]);
+        }
+        /* The zone may have moved to another channel since the key sounded. */
+        int old_channel = keys->voice_channel[pkey][z];
+        int channel = cache->zone_channel[z];
+        if (old_channel != channel) {
+            keys->voice_mask[pkey][z] = (noteset_t) {{0, 0}};
+            free_notes(inst, sink, time, old_channel, old, hold);
+            old = (noteset_t) {{0, 0}};
+        }
+        keys->voice_mask[pkey][z] = new;
+        keys->voice_channel[pkey][z] = channel;
+        free_notes(inst, sink, time, channel,
+                   (noteset_t) {{old.w[0] & ~new.w[0], old.w[1] & ~new.w[1]}}, hold);
+        for (int i=0; i<len; i++) {
+            int note = cache->packets[first+i][1];
+            if (noteset_has(&old, note)) {
+                continue;
+            }
+            if (noteset_has(&inst->sounding[channel], note)) {
+                send_note_off(sink, time, channel, note);
+            }
+            unsigned char *buffer = sink->reserve(sink->buf, time, 3);
+            if (buffer) {
+                memcpy(buffer, cache->packets[first+i], 3);
+            }
+            noteset_add(&inst->sounding[channel], note);
+            noteset_remove(&inst->sustained[channel], note);
+        }
+    }
+}
+
+static void
+send_expression_message(struct midi_sink *sink, uint32_t time, int status, int data1,
+                        int data2)
+{
+    unsigned char *buffer = sink->reserve(sink->buf, time, status == 0xd0 ? 2 : 3);
+    if (buffer) {
+        buffer[0] = status;
+        buffer[1] = data1;
+        if (status != 0xd0) {
+            buffer[2] = data2;
+        }
+    }
+}
+
+/* Send whichever of bend and the vertical controller changed since the last
+ * cycle, on every channel a zone plays on, from time on. Unsmoothed that is
+ * one message each; smoothed it is EXPRESSION_STEPS, evenly spaced through 
+ * the period and landing on the new value. */
+static void
+send_expression(struct lkey_instance *inst, struct midi_sink *sink, uint32_t nframes,
+                uint32_t time, uint32_t expression, const struct packet_cache *cache)
+{
+    uint32_t sent = inst->sent_expression;
+    int bend = expression & 0x3fff, from_bend = sent & 0x3fff;
+    int amount = expression >> 14 & 0x7f, from_amount = sent >> 14 & 0x7f;
+    int vertical = expression >> 21 & 3;
+    int steps = expression >> 23 & 1 ? EXPRESSION_STEPS : 1;
+    int send_amount = amount != from_amount;
+    if (vertical != (int) (sent >> 21 & 3)) {
+        /* A different controller: it starts from the amount, not from 
+         * where the old one was. */
+        from_amount = amount;
+        send_amount = 1;
+    }
+    int zones = 0;
+    for (int pkey=0; pkey<NUM_KEYS; pkey++) {
+        zones |= cache->routes[pkey];
+    }
+    uint16_t channels = 0;
+    for (int z=0; z<MAX_ZONES; z++) {
+        if (zones & (1 << z)) {
+            channels |= 1 << cache->zone_channel[z];
+        }
+    }
+    for (int s=1; s<=steps; s++) {
+        uint32_t at = (uint64_t) nframes * (s-1) / steps;
+        at = at < time ? time : at;
+        int b = from_bend + (bend - from_bend) * s / steps;
+        int a = from_amount + (amount - from_amount) * s / steps;
+        for (int channel=0; channel<16; channel++) {
+            if (!(channels & (1 << channel))) {
+                continue;
+            }
+            if (bend != from_bend) {
+                send_expression_message(sink, at, 0xe0 | channel, b & 0x7f, b >> 7);
+            }
+            if (send_amount && vertical == VERTICAL_PRESSURE) {
+                send_expression_message(sink, at, 0xd0 | channel, a, 0);
+            } else if (send_amount) {
+                send_expression_message(sink, at, 0xb0 | channel, 
+                                        vertical == VERTICAL_MODULATION ? 1 : 11, a);
+            }
+        }
+    }
+}
+
+/* Picks up sustain pedal (CC64) messages on any channel. */
+void 
+engine_midi_input(struct lkey_instance *inst, const unsigned char *data, size_t size)
+{
+    if (size == 3 && (data[0] & 0xf0) == 0xb0 && data[1] == 64) {
+        inst->midi_sustain = data[2] >= 64;
+    }
+    inst->midi_changed = 1;
+}
+
+/* Send the midi for one key event. While the sequencer runs, slot chords
+ * are replaced by its step's, whatever the key was pressed with. */
+static void
+play_key_event(struct lkey_instance *inst, struct midi_sink *sink, uint32_t time,
+               const struct key_event *key_event, const struct packet_cache *cache, 
+               int latch, int holding)
+{
+    struct key_state *keys = &inst->keys;
+    struct key_event sequenced = *key_event;
+    const struct key_event *event = key_event;
+    if (inst->seq_step >= 0 && key_event->chord != DIATONIC_CHORD) {
+        sequenced.chord = inst->seq_chord;
+        sequenced.inversion = inst->seq_inversion;
+        event = &sequenced;
+    }
+    int pkey = event->pkey;
+    if (keys->struck[pkey] != event->strike) {
+        /* A new press: release whatever the key has sounding, which
+         * also covers a release and re-press landing in one cycle. */
+        keys->struck[pkey] = event->strike;
+        release_key(inst, sink, time, pkey, holding);
+        if (event->pressed) {
+            /* With latch on, a new chord replaces the latched one. */
+            if (latch) {
+                flush_channels(inst, sink, time, inst->sustained);
+            }
+            voice_key(inst, sink, time, event, cache, holding);
+        }
+    } else if (event->pressed) {
+        /* Same press, new chord: only the notes that differ change. */
+        voice_key(inst, sink, time, event, cache, holding);
+    } else {
+        release_key(inst, sink, time, pkey, holding);
+    }
+}
+
+/* Hold event back until its frame. A revoice of a press that is itself still
+ * waiting just changes what that press will play. If there is no room the
+ * earliest event is played now, so each key's events stay in order. */
+static void
+schedule_event(struct lkey_instance *inst, struct midi_sink *sink, uint32_t time,
+               const struct key_event *event, const struct packet_cache *cache, 
+               int latch, int holding)
+{
+    for (int i=inst->num_scheduled-1; i>=0; i--) {
+        struct key_event *waiting = &inst->scheduled[i];
+        if (waiting->pkey == event->pkey) {
+            if (waiting->strike == event->strike && waiting->pressed == event->pressed) {
+                waiting->chord = event->chord;
+                waiting->inversion = event->inversion;
+                return;
+            }
+            break;
+        }
+    }
+    if (inst->num_scheduled == MAX_SCHEDULED) {
+        play_key_event(inst, sink, time, &inst->scheduled[0], cache, latch, holding);
+        inst->key_waiting[inst->scheduled[0].pkey]--;
+        memmove(inst->scheduled, inst->scheduled + 1, 
+                --inst->num_scheduled * sizeof(struct key_event));
+    }
+    int i = inst->num_scheduled++;
+    while (i > 0 && inst->scheduled[i-1].frame > event->frame) {
+        inst->scheduled[i] = inst->scheduled[i-1];
+        i--;
+    }
+    inst->scheduled[i] = *event;
+    inst->key_waiting[event->pkey]++;
+}
+
+/* THE SEQUENCER */
+
+#define NO_STEP UINT32_MAX
+
+/* Take a copy of the progression if the GTK thread changed it, unless it is
+ * being written right now; then it's picked up next cycle. */
+static void
+copy_progression(struct lkey_instance *inst)
+{
+    unsigned seq = atomic_load_explicit(&inst->progression_seq, memory_order_acquire);
+    if (seq == inst->seq_copied || (seq & 1)) {
+        return;
+    }
+    uint32_t steps[MAX_STEPS];
+    int num_steps = atomic_load_explicit(&inst->num_steps, memory_order_relaxed);
+    for (int i=0; i<num_steps; i++) {
+        steps[i] = atomic_load_explicit(&inst->progression[i], memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&inst->progression_seq, memory_order_relaxed) != seq) {
+        return;
+    }
+    memcpy(inst->seq_steps, steps, num_steps * sizeof(uint32_t));
+    inst->seq_num_steps = num_steps;
+    inst->seq_copied = seq;
+    /* Whatever step is playing may be a different chord now. */
+    inst->seq_step = -1;
+}
+
+/* Where the progression is at the start of this cycle. Returns the frame in
+ * the cycle the sequencer moves to step *next at, or NO_STEP if it stays 
+ * put. With transport rolling the position follows the song, so it lines 
+ * up with the bars however transport is moved; otherwise it runs freely at
+ * the sequencer's own tempo. */
+static uint32_t
+advance_sequencer(struct lkey_instance *inst, uint32_t nframes, 
+                  const struct transport *transport, int *next)
+{
+    copy_progression(inst);
+    if (!atomic_load_explicit(&inst->sequencing, memory_order_relaxed) || 
+        !inst->seq_num_steps || !transport || !transport->rate) {
+        if (inst->seq_step >= 0) {
+            inst->seq_step = -1;
+            atomic_store_explicit(&inst->seq_position, -1, memory_order_relaxed);
+        }
+        inst->seq_beat = 0;
+        return NO_STEP;
+    }
+    uint32_t total = 0;
+    for (int i=0; i<inst->seq_num_steps; i++) {
+        total += inst->seq_steps[i] >> 16;
+    }
+    double frames_per_beat, quarter;
+    if (transport->rolling) {
+        frames_per_beat = transport->frames_per_beat;
+        quarter = transport->beat * STEP_QUARTERS;
+    } else {
+        int tempo = atomic_load_explicit(&inst->seq_tempo, memory_order_relaxed);
+        frames_per_beat = transport->rate * 60.0 / tempo;
+        quarter = inst->seq_beat * STEP_QUARTERS;
+        inst->seq_beat += nframes / frames_per_beat;
+        if (inst->seq_beat * STEP_QUARTERS >= total) {
+            inst->seq_beat -= (double) total / STEP_QUARTERS;
+        }
+    }
+    /* Half a frame on, so a step ending between two frames belongs to the
+     * cycle with the nearer one, and the next cycle agrees. */
+    quarter += 0.5 * STEP_QUARTERS / frames_per_beat;
+    quarter -= (long) (quarter / total) * total;
+
+    int step = 0;
+    uint32_t end = inst->seq_steps[0] >> 16;
+    while (end <= quarter && step < inst->seq_num_steps - 1) {
+        end += inst->seq_steps[++step] >> 16;
+    }
+    if (step != inst->seq_step) {
+        *next = step;
+        return 0;
+    }
+    /* The frame nearest the end of the step. */
+    uint32_t at = (uint32_t) ((end - quarter) * frames_per_beat / STEP_QUARTERS) + 1;
+    if (at < nframes) {
+        *next = (step + 1) % inst->seq_num_steps;
+        return at;
+    }
+    return NO_STEP;
+}
+
+/* Move to step, once time has reached *step_at. Keys sounding a slot chord
+ * move with it, unless they are still waiting for the grid, in which case
+ * they will play the new chord when they get there. */
+static void
+take_step(struct lkey_instance *inst, struct midi_sink *sink, uint32_t time,
+          uint32_t *step_at, int step, const struct packet_cache *cache, int holding)
+{
+    struct key_state *keys = &inst->keys;
+    if (time < *step_at) {
+        return;
+    }
+    *step_at = NO_STEP;
+    uint32_t packed = inst->seq_steps[step];
+    inst->seq_step = step;
+    inst->seq_chord = packed & 0xff;
+    inst->seq_inversion = (int8_t) (packed >> 8);
+    atomic_store_explicit(&inst->seq_position, step << 8 | inst->seq_chord, 
+                          memory_order_relaxed);
+    for (int pkey=0; pkey<NUM_KEYS; pkey++) {
+        int sounding = 0;
+        for (int z=0; z<MAX_ZONES; z++) {
+            sounding |= !noteset_empty(&keys->voice_mask[pkey][z]);
+        }
+        uint32_t state = atomic_load_explicit(&keys->state[pkey], memory_order_relaxed);
+        if (sounding && !inst->key_waiting[pkey] && (state & 0xff) != DIATONIC_CHORD) {
+            struct key_event event = { inst->frame, pkey, keys->struck[pkey], 1, 
+                inst->seq_chord, inst->seq_inversion };
+            voice_key(inst, sink, time, &event, cache, holding);
+        }
+    }
+}
+
+/* Frames from the start of the cycle to the next grid line at or after it.
+ * Grid lines come in pairs, the second moved later by swing. */
+static uint32_t
+frames_to_grid(const struct transport *transport, int quantize, int swing)
+{
+    static const double whole_notes[] = {0, 1.0/8, 1.0/16, 1.0/12, 1.0/24};
+    double pair = 2 * whole_notes[quantize] * transport->beat_type;
+    double offbeat = pair * swing / 100;
+    double in_pair = transport->beat - (long) (transport->beat / pair) * pair;
+    double beats;
+    if (in_pair <= 0) {
+        beats = 0;
+    } else if (in_pair <= offbeat) {
+        beats = offbeat - in_pair;
+    } else {
+        beats = pair - in_pair;
+    }
+    return beats * transport->frames_per_beat + 0.5;
+}
+
+void 
+process_instance(struct lkey_instance *inst, struct midi_sink *sink, 
+                 uint32_t nframes, const struct transport *transport)
+{
+    uint64_t cycle_frame = inst->frame;
+    inst->frame += nframes;
+    uint64_t any = inst->midi_changed | inst->num_scheduled | (inst->seq_step >= 0);
+    inst->midi_changed = 0;
+    for (int w=0; w<KEY_MASK_WORDS; w++) {
+        any |= atomic_load_explicit(&inst->key_pending[w], memory_order_relaxed);
+    }
+    any |= atomic_load_explicit(&inst->controls_pending, memory_order_relaxed);
+    any |= atomic_load_explicit(&inst->sequencing, memory_order_relaxed);
+    uint32_t expression = atomic_load_explicit(&inst->expression, memory_order_relaxed);
+    any |= expression != inst->sent_expression;
+    if (!any) {
+        return;
+    }
+
+    struct key_state *keys = &inst->keys;
+    uint32_t time = 0;
+    uint64_t dirty[KEY_MASK_WORDS];
+    for (int w=0; w<KEY_MASK_WORDS; w++) {
+        dirty[w] = atomic_exchange_explicit(&inst->key_pending[w], 0, 
+                                            memory_order_acquire);
+    }
+    /* After taking the keys, so a cache published before a key was marked 
+     * is seen. */
+    const struct packet_cache *cache = cache_acquire(inst->cache);
+    atomic_exchange_explicit(&inst->controls_pending, 0, memory_order_acquire);
+    if (atomic_exchange_explicit(&inst->panic, 0, memory_order_relaxed)) {
+        /* Only the notes we know are on, not every note on every channel. 
+         * Whatever was waiting for the grid is forgotten too. */
+        flush_channels(inst, sink, 0, inst->sounding);
+        for (int pkey=0; pkey<NUM_KEYS; pkey++) {
+            for (int z=0; z<MAX_ZONES; z++) {
+                keys->voice_mask[pkey][z] = (noteset_t) {{0, 0}};
+            }
+            inst->key_delay[pkey] = 0;
+            inst->key_due[pkey] = 0;
+            inst->key_waiting[pkey] = 0;
+        }
+        inst->num_scheduled = 0;
+    }
+    int latch = atomic_load_explicit(&inst->latch, memory_order_relaxed);
+    int holding = latch || inst->midi_sustain || 
+        atomic_load_explicit(&inst->sustain_key, memory_order_relaxed);
+    int quantize = atomic_load_explicit(&inst->quantize, memory_order_relaxed);
+    uint32_t to_grid = 0;
+    if (quantize != QUANTIZE_OFF && transport && transport->rolling) {
+        to_grid = frames_to_grid(transport, quantize, 
+                                 atomic_load_explicit(&inst->swing, memory_order_relaxed));
+    }
+    /* Everything played from step_at on, in buffer order, gets the new step. */
+    int next_step = 0;
+    uint32_t step_at = advance_sequencer(inst, nframes, transport, &next_step);
+
+    for (int w=0; w<KEY_MASK_WORDS; w++) {
+        while (dirty[w]) {
+            int pkey = w*64 + __builtin_ctzll(dirty[w]);
+            dirty[w] &= dirty[w] - 1;
+            //printf("playing pkey:%d\n", pkey);
+            uint32_t state = atomic_load_explicit(&keys->state[pkey], 
+                                                  memory_order_acquire);
+            struct key_event event = { cycle_frame, pkey, state >> 24, 
+                state >> 16 & 1, state & 0xff, (int8_t) (state >> 8) };
+            if (keys->taken[pkey] != event.strike) {
+                keys->taken[pkey] = event.strike;
+                inst->key_delay[pkey] = to_grid;
+            }
+            event.frame += inst->key_delay[pkey];
+            if (event.frame < inst->key_due[pkey]) {
+                event.frame = inst->key_due[pkey];
+            }
+            /* Even an event due now waits behind the key's scheduled ones. */
+            if (event.frame > cycle_frame || inst->key_waiting[pkey]) {
+                schedule_event(inst, sink, time, &event, cache, latch, holding);
+                inst->key_due[pkey] = event.frame;
+                continue;
+            }
+            take_step(inst, sink, time, &step_at, next_step, cache, holding);
+            play_key_event(inst, sink, time, &event, cache, latch, holding);
+            /* Spread the keys out, but not past the period: JACK refuses an
+             * event there, and the key's notes would be tracked as sent. */
+            if (time + 3 < nframes) {
+                time += 3;
+            }
+        }
+    }
+
+    /* Held back events whose grid line falls in this cycle, at its frame. */
+    int due = 0;
+    while (due < inst->num_scheduled && 
+           inst->scheduled[due].frame < cycle_frame + nframes) {
+        const struct key_event *event = &inst->scheduled[due++];
+        if (event->frame - cycle_frame > time) {
+            time = event->frame - cycle_frame;
+        }
+        take_step(inst, sink, time, &step_at, next_step, cache, holding);
+        play_key_event(inst, sink, time, event, cache, latch, holding);
+        inst->key_waiting[event->pkey]--;
+    }
+    inst->num_scheduled -= due;
+    memmove(inst->scheduled, inst->scheduled + due, 
+            inst->num_scheduled * sizeof(struct key_event));
+    if (step_at != NO_STEP) {
+        time = step_at > time ? step_at : time;
+        take_step(inst, sink, time, &step_at, next_step, cache, holding);
+    }
+
+    /* Pedal up: everything it was holding goes off in this one cycle. */
+    if (inst->holding && !holding) {
+        flush_channels(inst, sink, time, inst->sustained);
+    }
+    inst->holding = holding;
+
+    /* Last, since smoothed steps run on through the period and midi has to
+     * go out in time order. */
+    if (expression != inst->sent_expression) {
+        send_expression(inst, sink, nframes, time, expression, cache);
+        inst->sent_expression = expression;
+    }
+}
@@ -0,0 +1,307 @@
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+/* The keyboard itself: instances, chords and the midi they produce. Nothing
+ * here knows about GTK or JACK, so the same code runs in the window, in 
+ * replays and in soak tests. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "noteset.h"
+
+#define NUM_KEYS 17
+/* Chord slots on one page of a bank. The number keys and keypad reach the 
+ * current page's, and only those are cached for process_cb. */
+#define NUM_CHORDS 10
+/* Slots in a row of the chord grid, which the arrow keys move across. */
+#define BANK_COLUMNS 5
+#define MAX_PAGES 1000
+#define MAX_CHORD_LEN 8
+/* Note and chord terminator: can't be zero because 
+ * that represents the unison interval. */
+#define CHTERM 255
+/* Words in the bitmask of keys with pending midi. */
+#define KEY_MASK_WORDS ((NUM_KEYS + 63) / 64)
+#define MAX_INSTANCES 8
+/* Chord index keys play with when harmony is diatonic; it comes after the 
+ * slots, so the cache and inversions treat it like one more chord. */
+#define DIATONIC_CHORD NUM_CHORDS
+#define NUM_CACHE_CHORDS (NUM_CHORDS + 1)
+
+enum harmony { HARMONY_SLOTS, HARMONY_TRIADS, HARMONY_SEVENTHS };
+enum quantize { QUANTIZE_OFF, QUANTIZE_8, QUANTIZE_16, QUANTIZE_8T, QUANTIZE_16T };
+/* What moving the pointer up and down the keyboard sends: CC1, CC11 or 
+ * channel pressure. */
+enum vertical { VERTICAL_MODULATION, VERTICAL_EXPRESSION, VERTICAL_PRESSURE };
+/* Key events waiting for a grid line, per instance. */
+#define MAX_SCHEDULED 256
+/* Zones per instance; zones can overlap, which layers them. */
+#define MAX_ZONES 4
+#define MAX_ZONE_OCTAVE 4
+/* A zone chord that follows the current chord instead of naming a slot. */
+#define ZONE_FOLLOW -1
+/* Steps in a progression. Step lengths are counted in quarters of a beat, 
+ * so the shortest is a quarter of one. */
+#define MAX_STEPS 32
+#define STEP_QUARTERS 4
+#define MAX_STEP_QUARTERS 0xffff
+/* Tempo the sequencer runs at when JACK transport isn't rolling. */
+#define DEFAULT_SEQ_TEMPO 120
+/* Pitch bend at rest, and how many steps a smoothed change is spread over
+ * within a period. */
+#define BEND_CENTRE 8192
+#define EXPRESSION_STEPS 4
+
+/* What an engine call changed, so the window knows what to redraw. */
+enum ui_change
+{
+    UI_KEYS = 1,       /* keys pressed or released */
+    UI_CHORD = 2,      /* current chord */
+    UI_INSTANCE = 4,   /* anything else shown for the active instance */
+    UI_NAME_CHORD = 8, /* a recorded chord is waiting for its name */
+    UI_PAGE = 16,      /* the page of the bank, or how many there are */
+    UI_SLOTS = 32,     /* names in the current page's slots */
+};
+
+/* Cleared to keep debug() quiet, e.g. while soaking. */
+extern int debug_enabled;
+void debug(char *format, ...);
+
+void copy_chord(int *dest, int *source);
+void invert_down(int *chord);
+void invert_up(int *chord);
+
+/* Key state is stored as one array per field, so the flags process_cb checks
+ * sit together. state[i] is what the GTK thread tells process_cb about key
+ * i, packed so one store publishes all of it: the chord and inversion it
+ * should play in bits 0-15, whether it is pressed in bit 16, and in the top
+ * byte a count of strikes, bumped on every press. taken, struck, voice_mask
+ * and voice_channel, the notes key i has sounding in each zone and the 
+ * channel they're on, are only touched by process_cb; taken runs ahead of 
+ * struck while a press waits for its grid line. */
+struct key_state
+{
+    _Atomic uint32_t state[NUM_KEYS];
+    uint8_t taken[NUM_KEYS];
+    uint8_t struck[NUM_KEYS];
+    noteset_t voice_mask[NUM_KEYS][MAX_ZONES];
+    uint8_t voice_channel[NUM_KEYS][MAX_ZONES];
+};
+
+/* A range of keys with its own chord, octave, velocity and channel. The 
+ * packet cache turns the zones into a table of which zones each key plays. */
+struct zone
+{
+    int enabled;
+    int low;
+    int high;
+    int chord;
+    int octave;
+    int velocity;
+    int channel;
+};
+
+/* A key's midi-relevant state at one moment. process_cb takes one from
+ * key_state for every pending key, and keeps it if the key is quantized. */
+struct key_event
+{
+    uint64_t frame;
+    uint8_t pkey;
+    uint8_t strike;
+    uint8_t pressed;
+    uint8_t chord;
+    int8_t inversion;
+};
+
+/* One step of a progression: a chord slot played at an inversion for a 
+ * number of beats. */
+struct progression_step
+{
+    int chord;
+    int inversion;
+    double beats;
+};
+
+struct cache_buffers;
+
+/* Everything one keyboard needs. All instances live in one array and are
+ * serviced by the same process_cb, each with its own output port. */
+struct lkey_instance
+{
+    struct key_state keys;
+    /* One bit per key whose midi hasn't been sent yet. Set by the GTK thread,
+     * taken by process_cb. */
+    _Atomic uint64_t key_pending[KEY_MASK_WORDS];
+    struct cache_buffers *cache;
+    /* The chord bank: num_pages pages of NUM_CHORDS slots, NULL where a slot
+     * is empty. chords_array and chord_names point at the current page's 
+     * slots, so everything else works on a page as it would on a fixed set
+     * of slots; there is no chords_array[DIATONIC_CHORD]. chord_inversion 
+     * holds the current page's inversions, bank_inversions every other's. 
+     * bank_recorded is the library entry last recorded into each slot, or 
+     * -1; recording the slot again replaces it. */
+    int **bank_chords;
+    char **bank_names;
+    int *bank_inversions;
+    int *bank_recorded;
+    int num_pages;
+    int page;
+    int **chords_array;
+    char **chord_names;
+    int chord_inversion[NUM_CACHE_CHORDS];
+    int current_chord;
+    int volume;
+    int base_note;
+    /* With diatonic harmony every key plays the in-scale chord of scale_mode
+     * on scale_root, whatever the current slot. */
+    int harmony; /* enum harmony */
+    int scale_root;
+    int scale_mode;
+    /* Held keys follow chord changes instead of keeping the chord they were
+     * pressed with. */
+    int live_revoice;
+    struct zone zones[MAX_ZONES];
+    /* Set by the GTK thread; controls_pending tells process_cb to look. */
+    _Atomic int sustain_key;
+    _Atomic int latch;
+    _Atomic int panic;
+    _Atomic int controls_pending;
+    /* Set by the GTK thread and read by process_cb as they are. swing is 
+     * where the second grid line of each pair falls, in percent: 50 is 
+     * straight. */
+    _Atomic int quantize; /* enum quantize */
+    _Atomic int swing;
+    /* Only touched by process_cb. sounding is every note left on, per 
+     * channel, and sustained the ones among them no key holds any more, kept
+     * on by the pedal or latch. midi_changed is set when midi input arrived
+     * this cycle. */
+    int midi_sustain;
+    int midi_changed;
+    int holding;
+    noteset_t sounding[16];
+    noteset_t sustained[16];
+    /* Frames processed so far, the clock scheduled events run on. A key 
+     * pressed off the grid has all its events held back by key_delay[pkey]
+     * frames until it is pressed again, so its release keeps the length it
+     * was played with. key_due[pkey] is the frame of its last scheduled 
+     * event, which nothing later for the key may overtake, and key_waiting
+     * [pkey] how many of its events are still scheduled. scheduled is sorted
+     * by frame. */
+    uint64_t frame;
+    uint32_t key_delay[NUM_KEYS];
+    uint64_t key_due[NUM_KEYS];
+    uint16_t key_waiting[NUM_KEYS];
+    struct key_event scheduled[MAX_SCHEDULED];
+    int num_scheduled;
+    /* The progression, written by the GTK thread under progression_seq, a 
+     * seqlock that is odd while a write is in progress. Each step is packed
+     * as chord | inversion << 8 | quarters << 16. */
+    _Atomic uint32_t progression[MAX_STEPS];
+    _Atomic int num_steps;
+    _Atomic unsigned progression_seq;
+    /* Set by the GTK thread: whether the sequencer runs, and its tempo for
+     * when transport isn't rolling. */
+    _Atomic int sequencing;
+    _Atomic int seq_tempo;
+    /* Set by process_cb each time it moves to a step, for the UI to follow:
+     * step << 8 | chord, or -1 while stopped. */
+    _Atomic int seq_position;
+    /* Only touched by process_cb: its copy of the progression and the seq it
+     * was taken at, the step playing and the chord and inversion everything
+     * plays while it does, and the free running position in beats. */
+    uint32_t seq_steps[MAX_STEPS];
+    int seq_num_steps;
+    unsigned seq_copied;
+    int seq_step;
+    int seq_chord;
+    int seq_inversion;
+    double seq_beat;
+    /* Pointer expression, packed so one store publishes all of it: bend 
+     * (0-16383) | amount (0-127) << 14 | vertical << 21 | smooth << 23. The
+     * GTK thread overwrites it as often as the pointer moves and process_cb
+     * sends whatever it finds there, once a cycle, so only the latest value
+     * of each goes out. sent_expression, only touched by process_cb, is the
+     * one it sent last. */
+    _Atomic uint32_t expression;
+    uint32_t sent_expression;
+};
+extern struct lkey_instance instances[MAX_INSTANCES];
+extern int num_instances;
+/* The instance the window is showing, and that receives key presses. */
+extern struct lkey_instance *active;
+/* 1 while a chord is being played in, 2 while it is being named. */
+extern int editing;
+/* Keycodes of the note keys, lowest first. */
+extern uint8_t note_keycodes[NUM_KEYS];
+
+void init_instance(struct lkey_instance *inst);
+void update_packet_cache(struct lkey_instance *inst);
+void update_held_keys(struct lkey_instance *inst);
+
+/* Everything the user can do. Each acts on the active instance, returns the
+ * enum ui_change bits for what changed, and is written to the session 
+ * recording if one is open. */
+int engine_key_pressed(unsigned keyval, unsigned keycode);
+int engine_key_released(unsigned keyval, unsigned keycode);
+int engine_click_chord(int n);
+int engine_edit_chord(int n);
+int engine_name_chord(const char *name);
+int engine_assign_chord(int n, const int *notes, const char *name);
+int engine_set_volume(int volume);
+int engine_set_harmony(int harmony, int root, int mode);
+int engine_set_latch(int on);
+int engine_set_live(int on);
+int engine_set_quantize(int quantize, int swing);
+int engine_set_zone(int z, int enabled, int low, int high, int chord, int octave, 
+                    int velocity, int channel);
+int engine_set_progression(const struct progression_step *steps, int num_steps);
+int engine_set_sequencer(int on, int tempo);
+/* Pitch bend (0-16383) and the amount (0-127) sent to the vertical 
+ * controller. Called for every pointer movement; process_cb coalesces. */
+int engine_set_expression(int bend, int amount);
+/* Which controller amount goes to, and whether changes are smoothed across
+ * the period instead of sent as one jump. */
+int engine_set_vertical(int vertical, int smooth);
+/* Not a user action: brings each instance's current chord up to the step 
+ * its sequencer has reached, through engine_follow_chord. That records the
+ * change as "follow n chord", so a replay, which has no GTK tick to call
+ * this from, moves the current chord at the same point in the session. */
+int engine_follow_sequencer(void);
+int engine_follow_chord(int n, int chord);
+int engine_panic(void);
+int engine_switch_instance(int n);
+/* Make page the one the number keys and clicks select from. One past the 
+ * last page adds an empty one. */
+int engine_show_page(int page);
+
+/* Where process_instance writes its midi: reserve returns room for size 
+ * bytes at frame time of the current cycle, or NULL if there is none. 
+ * jack_midi_event_reserve fits as is. */
+struct midi_sink
+{
+    unsigned char *(*reserve)(void *buf, uint32_t time, size_t size);
+    void *buf;
+};
+
+/* Where the musical grid is, for the cycle process_instance is running. */
+struct transport
+{
+    int rolling;
+    /* Beats since the start of bar 1, at the cycle's first frame. */
+    double beat;
+    double frames_per_beat;
+    /* The note value of a beat: 4 for quarter notes. */
+    double beat_type;
+    /* Frames per second, whether or not transport is rolling. */
+    uint32_t rate;
+};
+
+/* Called by process_cb, for each incoming event and then once per cycle. 
+ * transport may be NULL, meaning there is nothing to quantize to. */
+void engine_midi_input(struct lkey_instance *inst, const unsigned char *data, 
+                       size_t size);
+void process_instance(struct lkey_instance *inst, struct midi_sink *sink, 
+                      uint32_t nframes, const struct transport *transport);
+
+#endif
@@ -0,0 +1,178 @@
+/* 
+ * gentables: writes the lookup tables Lkey uses at runtime as a C source 
+ * file. Run by the build; see meson.build.
+ */
+#include <stdio.h>
+
+#include "tables.h"
+
+static const int major_scale[7] = {0, 2, 4, 5, 7, 9, 11};
+
+/* Chord qualities as intervals above the root, most likely reading first:
+ * when a set of pitch classes fits more than one, the earlier wins. Several
+ * entries can share a name, for voicings that leave the fifth out. */
+struct quality
+{
+    const char *name;
+    int intervals[7];
+};
+
+static const struct quality qualities[] = {
+    {"", {0, 4, 7, -1}},
+    {"m", {0, 3, 7, -1}},
+    {"7", {0, 4, 7, 10, -1}},
+    {"maj7", {0, 4, 7, 11, -1}},
+    {"m7", {0, 3, 7, 10, -1}},
+    {"dim", {0, 3, 6, -1}},
+    {"aug", {0, 4, 8, -1}},
+    {"sus4", {0, 5, 7, -1}},
+    {"sus2", {0, 2, 7, -1}},
+    {"5", {0, 7, -1}},
+    {"m7b5", {0, 3, 6, 10, -1}},
+    {"dim7", {0, 3, 6, 9, -1}},
+    {"6", {0, 4, 7, 9, -1}},
+    {"m6", {0, 3, 7, 9, -1}},
+    {"mmaj7", {0, 3, 7, 11, -1}},
+    {"7sus4", {0, 5, 7, 10, -1}},
+    {"7b5", {0, 4, 6, 10, -1}},
+    {"7#5", {0, 4, 8, 10, -1}},
+    {"maj7#5", {0, 4, 8, 11, -1}},
+    {"add9", {0, 2, 4, 7, -1}},
+    {"madd9", {0, 2, 3, 7, -1}},
+    {"9", {0, 2, 4, 7, 10, -1}},
+    {"maj9", {0, 2, 4, 7, 11, -1}},
+    {"m9", {0, 2, 3, 7, 10, -1}},
+    {"69", {0, 2, 4, 7, 9, -1}},
+    {"7b9", {0, 1, 4, 7, 10, -1}},
+    {"7#9", {0, 3, 4, 7, 10, -1}},
+    {"7#11", {0, 4, 6, 7, 10, -1}},
+    {"maj7#11", {0, 4, 6, 7, 11, -1}},
+    {"11", {0, 2, 4, 5, 7, 10, -1}},
+    {"m11", {0, 2, 3, 5, 7, 10, -1}},
+    {"13", {0, 2, 4, 7, 9, 10, -1}},
+    {"maj13", {0, 2, 4, 7, 9, 11, -1}},
+    {"7", {0, 4, 10, -1}},
+    {"maj7", {0, 4, 11, -1}},
+    {"m7", {0, 3, 10, -1}},
+    {"9", {0, 2, 4, 10, -1}},
+    {"7b9", {0, 1, 4, 10, -1}},
+    {"7#9", {0, 3, 4, 10, -1}},
+};
+#define NUM_QUALITIES (int) (sizeof(qualities) / sizeof(qualities[0]))
+
+/* Semitones from the tonic to each degree of mode (0 = Ionian). */
+static void mode_scale(int mode, int *scale)
+{
+    for (int d=0; d<7; d++) {
+        int step = major_scale[(mode + d) % 7] - major_scale[mode];
+        scale[d] = (step + 12) % 12;
+    }
+}
+
+/* The chord built in thirds on degree of scale, as intervals above its root. */
+static int degree_chord(const int *scale, int degree, int size, int *intervals)
+{
+    for (int i=0; i<size; i++) {
+        int d = degree + 2*i;
+        int note = scale[d % 7] + 12*(d / 7);
+        intervals[i] = note - scale[degree];
+    }
+    return size;
+}
+
+static void write_diatonic_chords(FILE *out)
+{
+    fprintf(out, "const struct diatonic_chord diatonic_chords[2][12][NUM_MODES][12] = {\n");
+    for (int sevenths=0; sevenths<2; sevenths++) {
+        fprintf(out, "  {\n");
+        for (int root=0; root<12; root++) {
+            fprintf(out, "    {\n");
+            for (int mode=0; mode<NUM_MODES; mode++) {
+                int scale[7];
+                mode_scale(mode, scale);
+                fprintf(out, "      {");
+                for (int pc=0; pc<12; pc++) {
+                    int intervals[4] = {0, 0, 0, 0};
+                    int len = 1;
+                    for (int d=0; d<7; d++) {
+                        if ((root + scale[d]) % 12 == pc) {
+                            len = degree_chord(scale, d, sevenths ? 4 : 3, intervals);
+                        }
+                    }
+                    fprintf(out, "{%d, {%d, %d, %d, %d}}%s", len, intervals[0], 
+                            intervals[1], intervals[2], intervals[3], pc<11 ? ", " : "");
+                }
+                fprintf(out, "},\n");
+            }
+            fprintf(out, "    },\n");
+        }
+        fprintf(out, "  },\n");
+    }
+    fprintf(out, "};\n");
+}
+
+static int quality_set(const struct quality *quality)
+{
+    int set = 0;
+    for (const int *i = quality->intervals; *i >= 0; i++) {
+        set |= 1 << *i;
+    }
+    return set;
+}
+
+/* set with pitch class root moved down to C. */
+static int rotate_down(int set, int root)
+{
+    return ((set >> root) | (set << (12 - root))) & 0xfff;
+}
+
+/* For every set of pitch classes: the root and quality it reads best as, 
+ * and the quality it has if C is taken as the root. */
+static void write_chord_names(FILE *out)
+{
+    fprintf(out, "const char *const chord_qualities[%d] = {", NUM_QUALITIES);
+    for (int q=0; q<NUM_QUALITIES; q++) {
+        fprintf(out, "%s\"%s\"", q % 8 ? " " : "\n  ", qualities[q].name);
+        fprintf(out, q < NUM_QUALITIES-1 ? "," : "\n");
+    }
+    fprintf(out, "};\n\n");
+    fprintf(out, "const struct pitch_class_set_name pitch_class_set_names[4096] = {\n");
+    for (int set=0; set<4096; set++) {
+        int root = -1, quality = NO_QUALITY, quality_on_c = NO_QUALITY;
+        for (int q=0; q<NUM_QUALITIES && root < 0; q++) {
+            for (int r=0; r<12 && root < 0; r++) {
+                if ((set & (1 << r)) && rotate_down(set, r) == quality_set(&qualities[q])) {
+                    root = r;
+                    quality = q;
+                }
+            }
+        }
+        for (int q=0; q<NUM_QUALITIES && quality_on_c == NO_QUALITY; q++) {
+            if (set == quality_set(&qualities[q])) {
+                quality_on_c = q;
+            }
+        }
+        fprintf(out, "  {%d, %d, %d},\n", root, quality, quality_on_c);
+    }
+    fprintf(out, "};\n");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s OUTPUT\n", argv[0]);
+        return 1;
+    }
+    FILE *out = fopen(argv[1], "w");
+    if (!out) {
+        perror(argv[1]);
+        return 1;
+    }
+    fprintf(out, "/* Generated by gentables.c. Do not edit. */\n\n");
+    fprintf(out, "#include <stdint.h>\n\n#include \"tables.h\"\n\n");
+    write_diatonic_chords(out);
+    fprintf(out, "\n");
+    write_chord_names(out);
+    fclose(out);
+    return 0;
+}
@@ -1,7 +1,13 @@
+#include <stdatomic.h>
 #include <gtk/gtk.h>
 
 #include "interface.h"
 #include "lkey.h"
+#include "library.h"
+#include "activity.h"
+#include "browser.h"
+#include "zones.h"
+#include "sequencer.h"
 
 /* UI SETUP CALLBACKS */
 
@@ -35,7 +41,9 @@ draw_shapes()
     int x = FIRST_KEY_OFFSET - HOR_GAP_BETWEEN_KEYS;  // Start one key length behind.
     int y = TOP_ROW_OFFSET + VERT_GAP_BETWEEN_ROWS;
     for (int i=0; i<17; i++) {
-        int on = key_state_buffer[i].pressed;
+        uint32_t state = atomic_load_explicit(&active->keys.state[i], 
+                                              memory_order_relaxed);
+        int on = state >> 16 & 1;
         if (key_colors[i]) { // black key
             cairo_rectangle (cr, x + HOR_OFFSET_BETWEEN_ROWS,
                              y - VERT_GAP_BETWEEN_ROWS, BLACK_KEY_WIDTH, BLACK_KEY_HEIGHT);
@@ -113,76 +121,645 @@ draw_cb (GtkDrawingArea *drawing_area,
     cairo_paint (cr);
 }
 
-char *chord_labels[10];
-void init_chord_labels() 
-{
-    chord_labels[0] = "No Chord";
-    chord_labels[1] = "Major";
-    chord_labels[2] = "Minor";
-    chord_labels[3] = "Diminished";
-    chord_labels[4] = "Augmented";
-}
+/* THE CHORD GRID */
+
+/* Slots count through the whole bank. current_label is the cell showing 
+ * the current slot, if it is in view; that is where new chords are named. */
+static int current_slot = -1;
+static int highlighted_slot = -1;
+static GtkWidget *current_label;
+/* The instance whose bank the model holds. */
+static struct lkey_instance *model_instance;
+
+static void changed_cb(GObject *self, GParamSpec *pspec, gpointer user_data);
 
-static void label_add_callbacks(GtkWidget *label, int index)
+/* Labels are made once per visible cell and reused for whichever slot 
+ * scrolls into it. */
+static void
+slot_setup_cb(GtkSignalListItemFactory *factory, GtkListItem *item, gpointer user_data)
 {
+    GtkWidget *label = gtk_editable_label_new("");
     gtk_editable_set_editable(GTK_EDITABLE(label), 0);
     gtk_editable_set_alignment(GTK_EDITABLE(label), 0.5);
+    gtk_widget_set_size_request(label, 90, 50);
     GtkGesture *label_controller1 = gtk_gesture_click_new();
     gtk_gesture_single_set_button(GTK_GESTURE_SINGLE(label_controller1), 1);
     gtk_widget_add_controller(label, GTK_EVENT_CONTROLLER(label_controller1));
-    g_signal_connect_after(label_controller1, "pressed", G_CALLBACK(click_on_chord_cb), &widgets.labels[index]);
+    g_signal_connect_after(label_controller1, "pressed", G_CALLBACK(click_on_chord_cb), item);
     GtkGesture *label_controller2 = gtk_gesture_click_new();
     gtk_gesture_single_set_button(GTK_GESTURE_SINGLE(label_controller2), 3);
     gtk_widget_add_controller(label, GTK_EVENT_CONTROLLER(label_controller2));
-    g_signal_connect_after(label_controller2, "pressed", G_CALLBACK(edit_chord_cb), &widgets.labels[index]);
+    g_signal_connect_after(label_controller2, "pressed", G_CALLBACK(edit_chord_cb), item);
+    g_signal_connect(label, "notify::editing", G_CALLBACK(changed_cb), NULL);
+    gtk_list_item_set_child(item, label);
 }
 
-static void 
-add_chord_labels(GtkWidget *box)
+/* The model holds each slot's name, "" for an empty one. */
+static void
+slot_bind_cb(GtkSignalListItemFactory *factory, GtkListItem *item, gpointer user_data)
+{
+    GtkWidget *label = gtk_list_item_get_child(item);
+    int slot = gtk_list_item_get_position(item);
+    const char *name = gtk_string_object_get_string(gtk_list_item_get_item(item));
+    gtk_editable_set_text(GTK_EDITABLE(label), name[0] ? name : "Empty");
+    if (name[0]) {
+        gtk_widget_remove_css_class(label, "inactive");
+    } else {
+        gtk_widget_add_css_class(label, "inactive");
+    }
+    if (slot == highlighted_slot) {
+        gtk_widget_add_css_class(label, "highlighted");
+    } else {
+        gtk_widget_remove_css_class(label, "highlighted");
+    }
+    if (slot == current_slot) {
+        current_label = label;
+    }
+}
+
+static void
+slot_unbind_cb(GtkSignalListItemFactory *factory, GtkListItem *item, gpointer user_data)
+{
+    if (gtk_list_item_get_child(item) == current_label) {
+        current_label = NULL;
+    }
+}
+
+/* Put slot's name back in the model, which rebinds its cell if it has 
+ * one; after its name or highlight changed. */
+static void
+refresh_slot(int slot)
+{
+    if (slot < 0 || slot >= (int) g_list_model_get_n_items(G_LIST_MODEL(widgets.chord_model)) ||
+        slot >= active->num_pages*NUM_CHORDS) {
+        return;
+    }
+    const char *names[] = {active->bank_names[slot] ? active->bank_names[slot] : "", NULL};
+    gtk_string_list_splice(widgets.chord_model, slot, 1, names);
+}
+
+/* Refresh the current page's slots whose names the model has wrong. */
+static void
+show_slot_names(void)
+{
+    for (int i=0; i<NUM_CHORDS; i++) {
+        int slot = active->page*NUM_CHORDS + i;
+        const char *shown = gtk_string_list_get_string(widgets.chord_model, slot);
+        const char *name = active->bank_names[slot] ? active->bank_names[slot] : "";
+        if (g_strcmp0(shown, name)) {
+            refresh_slot(slot);
+        }
+    }
+}
+
+/* Fill the model from the active instance's bank. Every cell rebinds, so 
+ * this is only for switching instance. */
+static void
+fill_chord_model(void)
+{
+    model_instance = active;
+    int slots = active->num_pages*NUM_CHORDS;
+    const char **names = g_new(const char *, slots + 1);
+    for (int i=0; i<slots; i++) {
+        names[i] = active->bank_names[i] ? active->bank_names[i] : "";
+    }
+    names[slots] = NULL;
+    gtk_string_list_splice(widgets.chord_model, 0, 
+                           g_list_model_get_n_items(G_LIST_MODEL(widgets.chord_model)), 
+                           names);
+    g_free(names);
+}
+
+static void
+show_page_label(void)
 {
-    init_chord_labels();
+    char text[32];
+    snprintf(text, sizeof(text), "Page %d of %d", active->page + 1, active->num_pages);
+    gtk_label_set_text(GTK_LABEL(widgets.page_label), text);
+}
 
+/* Scroll the grid to the current page, growing the model if a page was 
+ * added. */
+static void
+show_page(void)
+{
+    int slots = active->num_pages*NUM_CHORDS;
+    int shown = g_list_model_get_n_items(G_LIST_MODEL(widgets.chord_model));
+    for (; shown < slots; shown++) {
+        gtk_string_list_append(widgets.chord_model, "");
+    }
+    show_page_label();
+    gtk_widget_activate_action(widgets.chord_grid, "list.scroll-to-item", "u", 
+                               active->page*NUM_CHORDS);
+}
+
+static void
+page_back_cb(GtkButton *button, gpointer user_data)
+{
+    show_changes(engine_show_page(active->page - 1));
+}
+
+static void
+page_forward_cb(GtkButton *button, gpointer user_data)
+{
+    if (active->page < active->num_pages - 1) {
+        show_changes(engine_show_page(active->page + 1));
+    }
+}
+
+static void
+add_page_cb(GtkButton *button, gpointer user_data)
+{
+    show_changes(engine_show_page(active->num_pages));
+}
+
+/* The bank as a grid of BANK_COLUMNS columns, NUM_CHORDS slots to a page.
+ * Only the cells in view exist, however big the bank grows. */
+static void 
+add_chord_grid(GtkWidget *box)
+{
     GtkWidget *vertical_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
-    gtk_widget_set_size_request(vertical_box, 300, 300);
     gtk_widget_set_margin_top(vertical_box, 5);
     gtk_widget_set_margin_bottom(vertical_box, 5);
     gtk_widget_set_margin_end(vertical_box, 5);
     gtk_widget_set_halign(vertical_box, GTK_ALIGN_END);
 
-    GtkWidget *zero_label = gtk_editable_label_new(chord_labels[0]);
-    gtk_widget_set_size_request(zero_label, 150, 60);
-    gtk_widget_add_css_class(zero_label, "highlighted");
-    gtk_box_prepend(GTK_BOX(vertical_box), zero_label);
-    label_add_callbacks(zero_label, 0);
-    //g_signal_connect(zero_label, "changed", G_CALLBACK(edit_chord_cb), NULL);
-    widgets.labels[0] = zero_label;
-    int index = 1;
-    for (int row=0; row<3; row++) {
-        GtkWidget *row_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5); 
-        int active = 1;
-        for (int col=0; col<3; col++) {
-            char *chord_name;
-            if (chord_labels[index]) { 
-                chord_name = chord_labels[index]; 
-            } else {
-                chord_name = "Empty";
-                active = 0;
-            }
-            GtkWidget *chord_label = gtk_editable_label_new(chord_name);
-            if (!active) {
-                gtk_widget_add_css_class(chord_label, "inactive");
-            }
-            gtk_widget_set_size_request(chord_label, 100, 80);
-            gtk_box_append(GTK_BOX(row_box), chord_label);
-            label_add_callbacks(chord_label, index);
-            widgets.labels[index] = chord_label;
-            index += 1;
-        }
-        gtk_box_prepend(GTK_BOX(vertical_box), row_box);
+    widgets.chord_model = gtk_string_list_new(NULL);
+    GtkListItemFactory *factory = gtk_signal_list_item_factory_new();
+    g_signal_connect(factory, "setup", G_CALLBACK(slot_setup_cb), NULL);
+    g_signal_connect(factory, "bind", G_CALLBACK(slot_bind_cb), NULL);
+    g_signal_connect(factory, "unbind", G_CALLBACK(slot_unbind_cb), NULL);
+    GtkWidget *grid = gtk_grid_view_new(
+        GTK_SELECTION_MODEL(gtk_no_selection_new(G_LIST_MODEL(widgets.chord_model))), 
+        factory);
+    gtk_grid_view_set_min_columns(GTK_GRID_VIEW(grid), BANK_COLUMNS);
+    gtk_grid_view_set_max_columns(GTK_GRID_VIEW(grid), BANK_COLUMNS);
+    widgets.chord_grid = grid;
+    GtkWidget *scrolled = gtk_scrolled_window_new();
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled), GTK_POLICY_NEVER, 
+                                   GTK_POLICY_AUTOMATIC);
+    gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(scrolled), grid);
+    gtk_widget_set_size_request(scrolled, 500, 240);
+    gtk_widget_set_vexpand(scrolled, 1);
+    gtk_box_append(GTK_BOX(vertical_box), scrolled);
+
+    GtkWidget *pager = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    GtkWidget *back = gtk_button_new_with_label("<");
+    gtk_widget_set_tooltip_text(back, "Previous page (Page Up)");
+    g_signal_connect(back, "clicked", G_CALLBACK(page_back_cb), NULL);
+    gtk_box_append(GTK_BOX(pager), back);
+    widgets.page_label = gtk_label_new(NULL);
+    gtk_box_append(GTK_BOX(pager), widgets.page_label);
+    GtkWidget *forward = gtk_button_new_with_label(">");
+    gtk_widget_set_tooltip_text(forward, "Next page (Page Down)");
+    g_signal_connect(forward, "clicked", G_CALLBACK(page_forward_cb), NULL);
+    gtk_box_append(GTK_BOX(pager), forward);
+    GtkWidget *add = gtk_button_new_with_label("Add page");
+    g_signal_connect(add, "clicked", G_CALLBACK(add_page_cb), NULL);
+    gtk_box_append(GTK_BOX(pager), add);
+    gtk_box_append(GTK_BOX(vertical_box), pager);
+
+    gtk_box_append(GTK_BOX(box), vertical_box);
+    current_slot = highlighted_slot = active->page*NUM_CHORDS + active->current_chord;
+    fill_chord_model();
+    show_page_label();
+}
+
+static const char *harmony_names[] = {"Chord slots", "Diatonic triads", 
+    "Diatonic sevenths", NULL};
+static const char *root_names[] = {"C", "C#", "D", "Eb", "E", "F", "F#", "G", 
+    "Ab", "A", "Bb", "B", NULL};
+static const char *mode_names[] = {"Ionian", "Dorian", "Phrygian", "Lydian", 
+    "Mixolydian", "Aeolian", "Locrian", NULL};
+
+static const char *quantize_names[] = {"No quantize", "1/8", "1/16", 
+    "1/8 triplets", "1/16 triplets", NULL};
+
+static void
+quantize_changed_cb(GObject *dropdown, GParamSpec *pspec, gpointer user_data)
+{
+    engine_set_quantize(gtk_drop_down_get_selected(GTK_DROP_DOWN(dropdown)),
+                        atomic_load(&active->swing));
+}
+
+static void
+swing_changed_cb(GtkRange *range, gpointer user_data)
+{
+    engine_set_quantize(atomic_load(&active->quantize), gtk_range_get_value(range));
+}
+
+/* Presses wait for the next line of a grid taken from JACK transport. */
+static void
+add_quantize_controls(GtkWidget *box)
+{
+    GtkWidget *dropdown = gtk_drop_down_new_from_strings(quantize_names);
+    gtk_widget_set_tooltip_text(dropdown, "Quantize presses to JACK transport");
+    g_signal_connect(dropdown, "notify::selected", G_CALLBACK(quantize_changed_cb), NULL);
+    gtk_box_append(GTK_BOX(box), dropdown);
+    widgets.quantize_dropdown = dropdown;
+    GtkWidget *swing = gtk_scale_new_with_range(GTK_ORIENTATION_HORIZONTAL, 50, 75, 1);
+    gtk_widget_set_tooltip_text(swing, "Swing (%)");
+    gtk_scale_set_draw_value(GTK_SCALE(swing), 1);
+    gtk_range_set_value(GTK_RANGE(swing), 50);
+    g_signal_connect(swing, "value-changed", G_CALLBACK(swing_changed_cb), NULL);
+    gtk_box_append(GTK_BOX(box), swing);
+    widgets.swing_scale = swing;
+}
+
+static void
+latch_toggled_cb(GtkCheckButton *button, gpointer user_data)
+{
+    engine_set_latch(gtk_check_button_get_active(button));
+}
+
+static void
+live_toggled_cb(GtkCheckButton *button, gpointer user_data)
+{
+    engine_set_live(gtk_check_button_get_active(button));
+}
+
+static void
+panic_clicked_cb(GtkButton *button, gpointer user_data)
+{
+    engine_panic();
+}
+
+static void
+add_hold_controls(GtkWidget *box)
+{
+    GtkWidget *latch = gtk_check_button_new_with_label("Latch");
+    g_signal_connect(latch, "toggled", G_CALLBACK(latch_toggled_cb), NULL);
+    gtk_box_append(GTK_BOX(box), latch);
+    widgets.latch_button = latch;
+    GtkWidget *live = gtk_check_button_new_with_label("Live chords");
+    gtk_widget_set_tooltip_text(live, "Held keys follow chord changes");
+    g_signal_connect(live, "toggled", G_CALLBACK(live_toggled_cb), NULL);
+    gtk_box_append(GTK_BOX(box), live);
+    widgets.live_button = live;
+    GtkWidget *panic_button = gtk_button_new_with_label("Panic");
+    g_signal_connect(panic_button, "clicked", G_CALLBACK(panic_clicked_cb), NULL);
+    gtk_box_append(GTK_BOX(box), panic_button);
+}
+
+static const char *vertical_names[] = {"Modulation (CC1)", "Expression (CC11)",
+    "Channel pressure", NULL};
+
+static void
+vertical_changed_cb(void)
+{
+    engine_set_vertical(gtk_drop_down_get_selected(GTK_DROP_DOWN(widgets.vertical_dropdown)),
+        gtk_check_button_get_active(GTK_CHECK_BUTTON(widgets.smooth_button)));
+}
+
+static void
+vertical_selected_cb(GObject *dropdown, GParamSpec *pspec, gpointer user_data)
+{
+    vertical_changed_cb();
+}
+
+static void
+smooth_toggled_cb(GtkCheckButton *button, gpointer user_data)
+{
+    vertical_changed_cb();
+}
+
+/* What dragging over the keyboard sends up and down. */
+static void
+add_expression_controls(GtkWidget *box)
+{
+    GtkWidget *dropdown = gtk_drop_down_new_from_strings(vertical_names);
+    gtk_widget_set_tooltip_text(dropdown, "Sent by dragging up and down the keyboard");
+    gtk_box_append(GTK_BOX(box), dropdown);
+    widgets.vertical_dropdown = dropdown;
+    GtkWidget *smooth = gtk_check_button_new_with_label("Smooth");
+    gtk_widget_set_tooltip_text(smooth, "Spread bend and controller changes through each period");
+    gtk_box_append(GTK_BOX(box), smooth);
+    widgets.smooth_button = smooth;
+    g_signal_connect(dropdown, "notify::selected", G_CALLBACK(vertical_selected_cb), NULL);
+    g_signal_connect(smooth, "toggled", G_CALLBACK(smooth_toggled_cb), NULL);
+}
+
+/* Where the current drag over the keyboard started. */
+static double drag_start_y;
+
+/* The vertical amount for the pointer at height y: a stylus's pressure if it
+ * has one, otherwise 127 at the top of the keyboard and 0 at the bottom. */
+static int
+pointer_amount(GtkGesture *gesture, double y)
+{
+    double pressure;
+    GdkEvent *event = gtk_event_controller_get_current_event(GTK_EVENT_CONTROLLER(gesture));
+    if (event && gdk_event_get_axis(event, GDK_AXIS_PRESSURE, &pressure)) {
+        return pressure * 127 + 0.5;
     }
+    int height = gtk_widget_get_height(widgets.drawing_area);
+    return height > 0 ? (1 - y / height) * 127 + 0.5 : 0;
+}
+
+static void
+drag_begin_cb(GtkGestureDrag *gesture, double x, double y, gpointer user_data)
+{
+    drag_start_y = y;
+    engine_set_expression(BEND_CENTRE, pointer_amount(GTK_GESTURE(gesture), y));
+}
+
+/* Half the keyboard's width either way from the start bends all the way. 
+ * This fires for every motion event; the engine keeps only the latest. */
+static void
+drag_update_cb(GtkGestureDrag *gesture, double offset_x, double offset_y, 
+               gpointer user_data)
+{
+    int width = gtk_widget_get_width(widgets.drawing_area);
+    double bend = width > 0 ? offset_x * 2 / width : 0;
+    engine_set_expression(BEND_CENTRE + bend * BEND_CENTRE, 
+                          pointer_amount(GTK_GESTURE(gesture), drag_start_y + offset_y));
+}
+
+/* Bend springs back when the drag ends, and so does channel pressure; the
+ * controllers stay where they were left, like a mod wheel. */
+static void
+drag_end_cb(GtkGestureDrag *gesture, double offset_x, double offset_y, 
+            gpointer user_data)
+{
+    uint32_t expression = atomic_load(&active->expression);
+    int vertical = expression >> 21 & 3;
+    engine_set_expression(BEND_CENTRE, 
+                          vertical == VERTICAL_PRESSURE ? 0 : expression >> 14 & 0x7f);
+}
+
+static void
+add_expression_gesture(GtkWidget *drawing_area)
+{
+    GtkGesture *drag = gtk_gesture_drag_new();
+    gtk_gesture_single_set_button(GTK_GESTURE_SINGLE(drag), 1);
+    g_signal_connect(drag, "drag-begin", G_CALLBACK(drag_begin_cb), NULL);
+    g_signal_connect(drag, "drag-update", G_CALLBACK(drag_update_cb), NULL);
+    g_signal_connect(drag, "drag-end", G_CALLBACK(drag_end_cb), NULL);
+    gtk_widget_add_controller(drawing_area, GTK_EVENT_CONTROLLER(drag));
+}
+
+static void
+harmony_changed_cb(GObject *dropdown, GParamSpec *pspec, gpointer user_data)
+{
+    engine_set_harmony(gtk_drop_down_get_selected(GTK_DROP_DOWN(dropdown)),
+                       active->scale_root, active->scale_mode);
+}
+
+static void
+root_changed_cb(GObject *dropdown, GParamSpec *pspec, gpointer user_data)
+{
+    engine_set_harmony(active->harmony, 
+                       gtk_drop_down_get_selected(GTK_DROP_DOWN(dropdown)),
+                       active->scale_mode);
+}
+
+static void
+mode_changed_cb(GObject *dropdown, GParamSpec *pspec, gpointer user_data)
+{
+    engine_set_harmony(active->harmony, active->scale_root,
+                       gtk_drop_down_get_selected(GTK_DROP_DOWN(dropdown)));
+}
+
+static GtkWidget *
+add_harmony_dropdown(GtkWidget *box, const char **strings, GCallback callback)
+{
+    GtkWidget *dropdown = gtk_drop_down_new_from_strings(strings);
+    g_signal_connect(dropdown, "notify::selected", callback, NULL);
+    gtk_box_append(GTK_BOX(box), dropdown);
+    return dropdown;
+}
+
+static void
+add_harmony_controls(GtkWidget *box)
+{
+    GtkWidget *vertical_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+    gtk_widget_set_margin_top(vertical_box, 35);
+    gtk_widget_set_margin_end(vertical_box, 5);
+    widgets.harmony_dropdown = add_harmony_dropdown(vertical_box, harmony_names, 
+                                                    G_CALLBACK(harmony_changed_cb));
+    widgets.root_dropdown = add_harmony_dropdown(vertical_box, root_names, 
+                                                 G_CALLBACK(root_changed_cb));
+    widgets.mode_dropdown = add_harmony_dropdown(vertical_box, mode_names, 
+                                                 G_CALLBACK(mode_changed_cb));
+    add_quantize_controls(vertical_box);
+    add_hold_controls(vertical_box);
+    add_expression_controls(vertical_box);
     gtk_box_append(GTK_BOX(box), vertical_box);
 }
 
+/* Highlight the current chord; none while one is being recorded. Only the
+ * cells that change are rebound. */
+static void
+show_current_chord(void)
+{
+    int old_current = current_slot, old_highlighted = highlighted_slot;
+    current_slot = active->page*NUM_CHORDS + active->current_chord;
+    highlighted_slot = editing ? -1 : current_slot;
+    if (current_slot != old_current || highlighted_slot != old_highlighted) {
+        refresh_slot(old_current);
+        if (current_slot != old_current) {
+            refresh_slot(current_slot);
+        }
+    }
+}
+
+/* Refresh everything that shows per-instance state after switching. */
+void
+show_active_instance(void)
+{
+    if (active != model_instance) {
+        current_slot = active->page*NUM_CHORDS + active->current_chord;
+        highlighted_slot = editing ? -1 : current_slot;
+        fill_chord_model();
+    } else {
+        show_current_chord();
+    }
+    show_page();
+    gtk_range_set_value(GTK_RANGE(widgets.velocity_scale), active->volume);
+    gtk_drop_down_set_selected(GTK_DROP_DOWN(widgets.harmony_dropdown), active->harmony);
+    gtk_drop_down_set_selected(GTK_DROP_DOWN(widgets.root_dropdown), active->scale_root);
+    gtk_drop_down_set_selected(GTK_DROP_DOWN(widgets.mode_dropdown), active->scale_mode);
+    gtk_check_button_set_active(GTK_CHECK_BUTTON(widgets.latch_button), 
+                                atomic_load(&active->latch));
+    gtk_check_button_set_active(GTK_CHECK_BUTTON(widgets.live_button), 
+                                active->live_revoice);
+    gtk_drop_down_set_selected(GTK_DROP_DOWN(widgets.quantize_dropdown), 
+                               atomic_load(&active->quantize));
+    gtk_range_set_value(GTK_RANGE(widgets.swing_scale), atomic_load(&active->swing));
+    uint32_t expression = atomic_load(&active->expression);
+    gtk_drop_down_set_selected(GTK_DROP_DOWN(widgets.vertical_dropdown), expression >> 21 & 3);
+    gtk_check_button_set_active(GTK_CHECK_BUTTON(widgets.smooth_button), expression >> 23 & 1);
+    zones_refresh();
+    sequencer_refresh();
+    if (widgets.instance_dropdown) {
+        gtk_drop_down_set_selected(GTK_DROP_DOWN(widgets.instance_dropdown), 
+                                   active - instances);
+    }
+    gtk_widget_queue_draw(widgets.drawing_area);
+}
+
+static void
+changed_cb (GObject* self, GParamSpec* pspec,
+    gpointer user_data)
+{
+    if (!gtk_editable_label_get_editing(GTK_EDITABLE_LABEL(self)) && editing == 2 &&
+        GTK_WIDGET(self) == current_label) {
+        gtk_event_controller_set_propagation_phase(widgets.window_event_controller,
+        GTK_PHASE_CAPTURE);
+        gtk_editable_set_editable(GTK_EDITABLE(self), 0);
+        show_changes(engine_name_chord(gtk_editable_get_text(GTK_EDITABLE(self))));
+    }
+}
+
+/* Let the user name the chord just played in. The label starts out with
+ * its usual name, if it has one, so Enter is enough to keep that. Keys only
+ * go to the label once there is one to type in; without one the chord gets
+ * its usual name, or "Untitled", so recording always finishes. */
+static void 
+edit_chord_name(void)
+{
+    GtkWidget *chord_label = current_label;
+    char name[32];
+    int named = library_name_chord(active->chords_array[active->current_chord], name, 
+                                   sizeof(name));
+    if (!chord_label) {
+        show_changes(engine_name_chord(named ? name : "Untitled"));
+        return;
+    }
+    gtk_event_controller_set_propagation_phase(widgets.window_event_controller,
+    GTK_PHASE_TARGET);
+    if (named) {
+        gtk_editable_set_text(GTK_EDITABLE(chord_label), name);
+    }
+    gtk_editable_set_editable(GTK_EDITABLE(chord_label), 1);
+    gtk_editable_label_start_editing(GTK_EDITABLE_LABEL(chord_label)); 
+}
+
+/* Runs after the next layout, which binds the slot scrolled back into view. */
+static gboolean
+edit_chord_name_idle_cb(gpointer user_data)
+{
+    if (editing == 2) {
+        edit_chord_name();
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void 
+start_naming_chord(void)
+{
+    if (current_label) {
+        edit_chord_name();
+        return;
+    }
+    /* The slot scrolled out of view while being recorded and its cell went
+     * to another slot. */
+    gtk_widget_activate_action(widgets.chord_grid, "list.scroll-to-item", "u", 
+                               current_slot);
+    g_idle_add(edit_chord_name_idle_cb, NULL);
+}
+
+/* Bring the window up to date after an engine call; changes is the 
+ * enum ui_change bits it returned. */
+void
+show_changes(int changes)
+{
+    if (changes & UI_SLOTS) {
+        show_slot_names();
+    }
+    if (changes & UI_INSTANCE) {
+        show_active_instance();
+    } else if (changes & (UI_CHORD | UI_PAGE)) {
+        if (changes & UI_PAGE) {
+            show_page();
+        }
+        show_current_chord();
+    }
+    if (changes & UI_KEYS) {
+        gtk_widget_queue_draw(widgets.drawing_area);
+    }
+    if (changes & UI_NAME_CHORD) {
+        start_naming_chord();
+    }
+}
+
+static void
+instance_selected_cb(GObject *dropdown, GParamSpec *pspec, gpointer user_data)
+{
+    show_changes(engine_switch_instance(gtk_drop_down_get_selected(GTK_DROP_DOWN(dropdown))));
+}
+
+static void
+library_clicked_cb(GtkButton *button, gpointer window)
+{
+    browser_show(GTK_WINDOW(window));
+}
+
+static void
+add_library_button(GObject *header, GObject *window)
+{
+    GtkWidget *button = gtk_button_new_with_label("Library");
+    gtk_widget_set_tooltip_text(button, "Search the chord library");
+    g_signal_connect(button, "clicked", G_CALLBACK(library_clicked_cb), window);
+    gtk_header_bar_pack_end(GTK_HEADER_BAR(header), button);
+}
+
+static void
+zones_clicked_cb(GtkButton *button, gpointer window)
+{
+    zones_show(GTK_WINDOW(window));
+}
+
+static void
+add_zones_button(GObject *header, GObject *window)
+{
+    GtkWidget *button = gtk_button_new_with_label("Zones");
+    gtk_widget_set_tooltip_text(button, "Split and layer the keyboard");
+    g_signal_connect(button, "clicked", G_CALLBACK(zones_clicked_cb), window);
+    gtk_header_bar_pack_end(GTK_HEADER_BAR(header), button);
+}
+
+static void
+sequencer_clicked_cb(GtkButton *button, gpointer window)
+{
+    sequencer_show(GTK_WINDOW(window));
+}
+
+static void
+add_sequencer_button(GObject *header, GObject *window)
+{
+    GtkWidget *button = gtk_button_new_with_label("Sequencer");
+    gtk_widget_set_tooltip_text(button, "Step through a chord progression");
+    g_signal_connect(button, "clicked", G_CALLBACK(sequencer_clicked_cb), window);
+    gtk_header_bar_pack_end(GTK_HEADER_BAR(header), button);
+}
+
+/* The sequencers move chords on their own; the highlight catches up once a
+ * frame. */
+static gboolean
+follow_sequencer_cb(GtkWidget *widget, GdkFrameClock *frame_clock, gpointer user_data)
+{
+    sequencer_follow();
+    return G_SOURCE_CONTINUE;
+}
+
+/* Only shown when there is more than one instance to pick from. */
+static void
+add_instance_dropdown(GObject *header)
+{
+    char names[MAX_INSTANCES][16];
+    const char *strings[MAX_INSTANCES+1];
+    for (int n=0; n<num_instances; n++) {
+        snprintf(names[n], sizeof(names[n]), "Keyboard %d", n+1);
+        strings[n] = names[n];
+    }
+    strings[num_instances] = NULL;
+    GtkWidget *dropdown = gtk_drop_down_new_from_strings(strings);
+    g_signal_connect(dropdown, "notify::selected", G_CALLBACK(instance_selected_cb), NULL);
+    gtk_header_bar_pack_start(GTK_HEADER_BAR(header), dropdown);
+    widgets.instance_dropdown = dropdown;
+}
+
 static void
 preferences_activated (GSimpleAction *action,
                        GVariant      *parameter,
@@ -237,10 +814,20 @@ activate_cb (GtkApplication* app,
     /* Connect velocity slider("Scale") */
     GObject *hor_box = gtk_builder_get_object(builder, "upper_box");
     GObject *velocity_scale = gtk_builder_get_object(builder, "vel_scale");
-    gtk_range_set_value(GTK_RANGE(velocity_scale), 127);
+    gtk_range_set_value(GTK_RANGE(velocity_scale), active->volume);
     g_signal_connect(velocity_scale, "value-changed", G_CALLBACK(volume_changed_cb), NULL);
+    widgets.velocity_scale = GTK_WIDGET(velocity_scale);
 
-    add_chord_labels(GTK_WIDGET(hor_box));
+    if (num_instances > 1) {
+        add_instance_dropdown(gtk_builder_get_object(builder, "header"));
+    }
+    add_library_button(gtk_builder_get_object(builder, "header"), window);
+    add_zones_button(gtk_builder_get_object(builder, "header"), window);
+    add_sequencer_button(gtk_builder_get_object(builder, "header"), window);
+    gtk_widget_add_tick_callback(GTK_WIDGET(window), follow_sequencer_cb, NULL, NULL);
+
+    add_harmony_controls(GTK_WIDGET(hor_box));
+    add_chord_grid(GTK_WIDGET(hor_box));
     GObject *vert_box = gtk_builder_get_object(builder, "content_box"); 
 
     /* Draw the keyboard in a DrawingArea */
@@ -250,6 +837,10 @@ activate_cb (GtkApplication* app,
     gtk_box_append(GTK_BOX(vert_box), drawing_area);
     gtk_drawing_area_set_draw_func (GTK_DRAWING_AREA(drawing_area), draw_cb, NULL, NULL);
     g_signal_connect_after (GTK_WIDGET(drawing_area), "resize", G_CALLBACK (resize_cb), NULL);
+    add_expression_gesture(drawing_area);
+
+    /* What actually went out, scrolling under the keyboard */
+    gtk_box_append(GTK_BOX(vert_box), activity_strip_new());
 
     /* Connect basic key press and mouse click callbacks */
     keypress = gtk_event_controller_key_new();
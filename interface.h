@@ -4,9 +4,24 @@
 struct widget_struct {
     GtkEventController *window_event_controller;
     GtkWidget *drawing_area;
-    GtkWidget *labels[10];
+    GtkWidget *chord_grid;
+    GtkStringList *chord_model;
+    GtkWidget *page_label;
+    GtkWidget *velocity_scale;
+    GtkWidget *instance_dropdown;
+    GtkWidget *harmony_dropdown;
+    GtkWidget *root_dropdown;
+    GtkWidget *mode_dropdown;
+    GtkWidget *latch_button;
+    GtkWidget *live_button;
+    GtkWidget *quantize_dropdown;
+    GtkWidget *swing_scale;
+    GtkWidget *vertical_dropdown;
+    GtkWidget *smooth_button;
 }; 
 extern struct widget_struct widgets;
 
 void activate_cb(GtkApplication* app, gpointer user_data);
+void show_active_instance(void);
+void show_changes(int changes);
 #endif 
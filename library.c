@@ -0,0 +1,373 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "library.h"
+#include "tables.h"
+
+#define TRIGRAM_BUCKETS 65536
+#define NUM_SHAPES 4096
+#define MAX_QUERY 64
+#define MAX_NAME 32
+
+/* A growable list of chord indexes, in the order the chords were added. */
+struct posting
+{
+    int *ids;
+    int count;
+    int size;
+};
+
+struct library_chord *library;
+int library_size;
+static int library_capacity;
+/* One bit per chord, for each pitch class, set if the chord contains it. */
+static uint64_t *pitch_class_bits[12];
+static struct posting shapes[NUM_SHAPES];
+/* Chords by the trigrams in their folded names. Trigrams are hashed into 
+ * buckets, so a bucket can hold chords that only look like matches. */
+static struct posting trigrams[TRIGRAM_BUCKETS];
+
+static const char *note_names[12] = {"C", "C#", "D", "Eb", "E", "F", "F#", "G", 
+    "Ab", "A", "Bb", "B"};
+
+/* Keeps ids in order. New chords go at the end; only a replaced one can
+ * land further in. */
+static void
+posting_add(struct posting *posting, int id)
+{
+    int i = posting->count;
+    while (i > 0 && posting->ids[i-1] > id) {
+        i--;
+    }
+    /* A trigram can turn up twice in one name. */
+    if (i > 0 && posting->ids[i-1] == id) {
+        return;
+    }
+    if (posting->count == posting->size) {
+        posting->size = posting->size ? 2*posting->size : 8;
+        posting->ids = realloc(posting->ids, posting->size*sizeof(int));
+    }
+    memmove(posting->ids + i + 1, posting->ids + i, (posting->count - i)*sizeof(int));
+    posting->ids[i] = id;
+    posting->count++;
+}
+
+static void
+posting_remove(struct posting *posting, int id)
+{
+    for (int i=posting->count-1; i>=0; i--) {
+        if (posting->ids[i] == id) {
+            posting->count--;
+            memmove(posting->ids + i, posting->ids + i + 1, 
+                    (posting->count - i)*sizeof(int));
+            return;
+        }
+    }
+}
+
+static unsigned
+trigram_bucket(const char *s)
+{
+    uint32_t trigram = (uint8_t) s[0] << 16 | (uint8_t) s[1] << 8 | (uint8_t) s[2];
+    return (trigram * 2654435761u) >> 16;
+}
+
+static void
+fold(char *dest, const char *source, size_t size)
+{
+    size_t i;
+    for (i=0; i+1<size && source[i]; i++) {
+        dest[i] = tolower((unsigned char) source[i]);
+    }
+    dest[i] = 0;
+}
+
+static void
+grow_library(void)
+{
+    int old_words = (library_capacity + 63) / 64;
+    library_capacity = library_capacity ? 2*library_capacity : 64;
+    library = realloc(library, library_capacity*sizeof(struct library_chord));
+    int words = (library_capacity + 63) / 64;
+    for (int pc=0; pc<12; pc++) {
+        pitch_class_bits[pc] = realloc(pitch_class_bits[pc], words*sizeof(uint64_t));
+        memset(pitch_class_bits[pc] + old_words, 0, (words - old_words)*sizeof(uint64_t));
+    }
+}
+
+int
+library_name_chord(const int *notes, char *name, size_t size)
+{
+    int pitch_classes = 0;
+    int bass = 256;
+    for (int i=0; i<MAX_CHORD_LEN && notes[i] != CHTERM; i++) {
+        pitch_classes |= 1 << (((notes[i] % 12) + 12) % 12);
+        if (notes[i] < bass) {
+            bass = notes[i];
+        }
+    }
+    if (!pitch_classes) {
+        return 0;
+    }
+    /* Look the set up as played from its bass, so a bass that can be the 
+     * root is: C E G A reads C6 from C and Am7/C only if C can't be root. */
+    bass = ((bass % 12) + 12) % 12;
+    int from_bass = ((pitch_classes >> bass) | (pitch_classes << (12 - bass))) & 0xfff;
+    const struct pitch_class_set_name *entry = &pitch_class_set_names[from_bass];
+    if (entry->quality_on_c != NO_QUALITY) {
+        snprintf(name, size, "%s%s", note_names[bass], chord_qualities[entry->quality_on_c]);
+    } else if (entry->root >= 0) {
+        snprintf(name, size, "%s%s/%s", note_names[(entry->root + bass) % 12], 
+                 chord_qualities[entry->quality], note_names[bass]);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/* Fill in chord id and put it in the indexes. */
+static void
+set_chord(int id, const char *name, const int *notes)
+{
+    struct library_chord *chord = &library[id];
+    char canonical[MAX_NAME] = "";
+    library_name_chord(notes, canonical, sizeof(canonical));
+    chord->name = strdup(name);
+    chord->canonical = strdup(canonical);
+    size_t size = strlen(name) + strlen(canonical) + 2;
+    chord->folded = malloc(size);
+    snprintf(chord->folded, size, "%s\t%s", name, canonical);
+    fold(chord->folded, chord->folded, size);
+
+    int len = 0;
+    int lowest = 256;
+    while (len < MAX_CHORD_LEN && notes[len] != CHTERM) {
+        chord->notes[len] = notes[len];
+        if (notes[len] < lowest) {
+            lowest = notes[len];
+        }
+        len++;
+    }
+    chord->notes[len] = CHTERM;
+    chord->pitch_classes = 0;
+    chord->shape = 0;
+    for (int i=0; i<len; i++) {
+        chord->pitch_classes |= 1 << (((notes[i] % 12) + 12) % 12);
+        chord->shape |= 1 << ((notes[i] - lowest) % 12);
+    }
+
+    for (int pc=0; pc<12; pc++) {
+        if (chord->pitch_classes & (1 << pc)) {
+            pitch_class_bits[pc][id/64] |= (uint64_t) 1 << (id%64);
+        }
+    }
+    posting_add(&shapes[chord->shape], id);
+    for (int i=0; chord->folded[i] && chord->folded[i+1] && chord->folded[i+2]; i++) {
+        posting_add(&trigrams[trigram_bucket(chord->folded + i)], id);
+    }
+}
+
+/* Take chord id out of the indexes and free its names. */
+static void
+clear_chord(int id)
+{
+    struct library_chord *chord = &library[id];
+    for (int pc=0; pc<12; pc++) {
+        pitch_class_bits[pc][id/64] &= ~((uint64_t) 1 << (id%64));
+    }
+    posting_remove(&shapes[chord->shape], id);
+    for (int i=0; chord->folded[i] && chord->folded[i+1] && chord->folded[i+2]; i++) {
+        posting_remove(&trigrams[trigram_bucket(chord->folded + i)], id);
+    }
+    free(chord->name);
+    free(chord->canonical);
+    free(chord->folded);
+}
+
+int 
+library_add(const char *name, const int *notes)
+{
+    if (library_size == library_capacity) {
+        grow_library();
+    }
+    int id = library_size++;
+    set_chord(id, name, notes);
+    return id;
+}
+
+void
+library_replace(int id, const char *name, const int *notes)
+{
+    clear_chord(id);
+    set_chord(id, name, notes);
+}
+
+int 
+library_load(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+    char line[256];
+    int added = 0;
+    while (fgets(line, sizeof(line), file)) {
+        char *colon = strchr(line, ':');
+        if (line[0] == '#' || !colon) {
+            continue;
+        }
+        char *name = line;
+        while (isspace((unsigned char) *name)) {
+            name++;
+        }
+        char *name_end = colon;
+        while (name_end > name && isspace((unsigned char) name_end[-1])) {
+            name_end--;
+        }
+        *name_end = 0;
+
+        int notes[MAX_CHORD_LEN + 1];
+        int len = 0;
+        char *p = colon + 1, *end;
+        long note;
+        while (len < MAX_CHORD_LEN && (note = strtol(p, &end, 10), end != p) &&
+               note > -128 && note < 128) {
+            notes[len++] = note;
+            p = end;
+        }
+        notes[len] = CHTERM;
+        char canonical[MAX_NAME];
+        if (len && !*name && library_name_chord(notes, canonical, sizeof(canonical))) {
+            name = canonical;
+        }
+        if (len && *name) {
+            library_add(name, notes);
+            added++;
+        }
+    }
+    fclose(file);
+    return added;
+}
+
+uint16_t 
+library_parse_pitch_classes(const char *text)
+{
+    static const int letters[7] = {9, 11, 0, 2, 4, 5, 7}; /* A to G */
+    uint16_t pitch_classes = 0;
+    const char *p = text;
+    while (*p) {
+        if (isspace((unsigned char) *p) || *p == ',') {
+            p++;
+            continue;
+        }
+        int letter = toupper((unsigned char) *p) - 'A';
+        if (letter < 0 || letter > 6) {
+            return 0;
+        }
+        int pc = letters[letter];
+        for (p++; *p == '#' || *p == 'b'; p++) {
+            pc += *p == '#' ? 1 : -1;
+        }
+        pitch_classes |= 1 << ((pc + 12) % 12);
+    }
+    return pitch_classes;
+}
+
+uint16_t 
+library_parse_shape(const char *text)
+{
+    /* The lowest note is always there, whether it's written or not. */
+    uint16_t shape = 1;
+    const char *p = text;
+    char *end;
+    long interval;
+    while ((interval = strtol(p, &end, 10), end != p)) {
+        if (interval < 0) {
+            return 0;
+        }
+        shape |= 1 << (interval % 12);
+        p = end;
+        /* strtol skips the spaces before a number, not those after the
+         * last one. */
+        while (isspace((unsigned char) *p) || *p == ',') {
+            p++;
+        }
+    }
+    return *p ? 0 : shape;
+}
+
+static int
+add_result(int *results, int max, int found, int id)
+{
+    if (found < max) {
+        results[found] = id;
+    }
+    return found + 1;
+}
+
+int 
+library_find_name(const char *text, int *results, int max)
+{
+    char query[MAX_QUERY];
+    fold(query, text, sizeof(query));
+    int len = strlen(query);
+    int found = 0;
+    if (len < 3) {
+        for (int id=0; id<library_size; id++) {
+            if (strstr(library[id].folded, query)) {
+                found = add_result(results, max, found, id);
+            }
+        }
+        return found;
+    }
+    /* Every match has all the query's trigrams, so only the chords under 
+     * the rarest one need looking at. */
+    struct posting *rarest = NULL;
+    for (int i=0; i+3<=len; i++) {
+        struct posting *posting = &trigrams[trigram_bucket(query + i)];
+        if (!rarest || posting->count < rarest->count) {
+            rarest = posting;
+        }
+    }
+    for (int i=0; i<rarest->count; i++) {
+        int id = rarest->ids[i];
+        if (strstr(library[id].folded, query)) {
+            found = add_result(results, max, found, id);
+        }
+    }
+    return found;
+}
+
+int 
+library_find_pitch_classes(uint16_t pitch_classes, int *results, int max)
+{
+    int found = 0;
+    int words = (library_size + 63) / 64;
+    for (int w=0; w<words; w++) {
+        uint64_t bits = w == words-1 && library_size % 64 ? 
+            ((uint64_t) 1 << (library_size % 64)) - 1 : ~(uint64_t) 0;
+        for (int pc=0; pc<12; pc++) {
+            if (pitch_classes & (1 << pc)) {
+                bits &= pitch_class_bits[pc][w];
+            }
+        }
+        while (bits) {
+            found = add_result(results, max, found, w*64 + __builtin_ctzll(bits));
+            bits &= bits - 1;
+        }
+    }
+    return found;
+}
+
+int 
+library_find_shape(uint16_t shape, int *results, int max)
+{
+    struct posting *posting = &shapes[shape % NUM_SHAPES];
+    for (int i=0; i<posting->count && i<max; i++) {
+        results[i] = posting->ids[i];
+    }
+    return posting->count;
+}
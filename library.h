@@ -0,0 +1,58 @@
+#ifndef __LIBRARY_H__
+#define __LIBRARY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "engine.h"
+
+/* Every chord Lkey knows about, searchable by name, by the pitch classes it
+ * contains and by its interval structure. Notes are semitones above the C 
+ * key, as recorded chords store them, so pitch classes read as if the chord
+ * were played from C. The indexes grow as chords are added, so a search 
+ * never has to look at chords that can't match. */
+struct library_chord
+{
+    char *name;
+    /* The name library_name_chord gives its notes, or "" if it has none. */
+    char *canonical;
+    /* Both names in lower case, tab separated, for matching names. */
+    char *folded;
+    int notes[MAX_CHORD_LEN + 1];
+    /* Bit n set for pitch class n, C being 0. */
+    uint16_t pitch_classes;
+    /* The same for intervals above the lowest note. */
+    uint16_t shape;
+};
+
+extern struct library_chord *library;
+extern int library_size;
+
+/* Add a chord; notes ends with CHTERM. Returns its index. */
+int library_add(const char *name, const int *notes);
+/* Put another chord in place of chord id, keeping its index. */
+void library_replace(int id, const char *name, const int *notes);
+/* Load a bank: one chord per line, "name: notes", notes being semitones 
+ * above C, e.g. "Cmaj7/E: 4 7 11 12". A line with no name, such as 
+ * ": 4 7 11 12", gets its canonical one. Returns the number of chords 
+ * added, or -1 if the file can't be read. */
+int library_load(const char *path);
+
+/* Write the usual name for notes into name, e.g. "Cmaj7/E" for 4 7 11 12:
+ * a root, a quality and, if the bass isn't the root, the bass. Takes one
+ * lookup in a table generated at build time. Returns 0, leaving name 
+ * alone, if the notes don't read as any chord the table knows. */
+int library_name_chord(const int *notes, char *name, size_t size);
+
+/* Parse notes such as "E B" or "F# Bb" into a pitch class mask, and 
+ * intervals such as "0 4 7" into a shape. Return 0 if nothing parses. */
+uint16_t library_parse_pitch_classes(const char *text);
+uint16_t library_parse_shape(const char *text);
+
+/* Searches put the indexes of up to max matching chords in results, oldest
+ * first, and return how many chords match in all. */
+int library_find_name(const char *text, int *results, int max);
+int library_find_pitch_classes(uint16_t pitch_classes, int *results, int max);
+int library_find_shape(uint16_t shape, int *results, int max);
+
+#endif
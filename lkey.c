@@ -1,6 +1,6 @@
 #include <signal.h>
 #include <stdint.h>
-#include <stdarg.h>
+#include <string.h>
 #include <unistd.h>
 #include <gtk/gtk.h>
 #include <jack/jack.h>
@@ -8,263 +8,29 @@
 
 #include "lkey.h"
 #include "interface.h"
-
-/* Note and chord terminator: can't be zero because 
- * that represents the unison interval. */
-#define CHTERM 255
-#define BASE_NOTE 60
-#define NUM_CHORDS 10
-#define DEFAULT_CHORDS 5
-
-#define VELOCITY 127
-
-#define DEBUG 1
+#include "library.h"
+#include "replay.h"
+#include "telemetry.h"
+#include "netout.h"
+#include "soak.h"
+#include "rt.h"
 
 /* GLOBAL VARS */
 
 jack_client_t *client;
-jack_port_t *output_port;
-
-int chord_unity[2] = {0, CHTERM};
-int chord_major_triad[4] = {0, 4, 7, CHTERM};
-int chord_minor_triad[4] = {0, 3, 7, CHTERM}; 
-int chord_dim_triad[4] = {0, 3, 6, CHTERM};
-int chord_aug_triad[10] = {0, 4, 8, CHTERM};
-int *chords_array[NUM_CHORDS] = {chord_unity, chord_major_triad,
-                            chord_minor_triad, chord_dim_triad, chord_aug_triad, 
-                            NULL, NULL, NULL, NULL, NULL};
-int current_chord = 0;
-int volume = VELOCITY;
-int base_note = BASE_NOTE;
-int editing = 0;
-int editing_i = 0;
-int num_chords = DEFAULT_CHORDS;
-
-uint8_t note_keycodes[NUM_KEYS] = { 52, 39, 53, 40, 54, 55, 42, 56, 43, 57, 44, 58, 59, 46, 60, 47, 61}; 
-uint8_t keypad_keycodes[10] = {90, 87, 88, 89, 83, 84, 85, 79, 80, 81};
-
-void debug(char *format, ...) {
-#if DEBUG
-    va_list args;
-    va_start(args, format );
-    vfprintf(stderr, format, args );
-    va_end(args);
-#endif
-}
-
-struct key_state key_state_buffer[NUM_KEYS];
-
-void init_key_state_buffer() 
-{
-    for (int i=0; i<NUM_KEYS; i++ ) {
-        key_state_buffer[i].pressed = 0;
-        key_state_buffer[i].midi_updated = 1; }
-}
-
-void copy_chord(int *dest, int *source);
-void update_key_state_buffer_new_chord()
-{
-    for (int i=0; i<NUM_KEYS; i++) {
-        if (!key_state_buffer[i].pressed) {
-            copy_chord(key_state_buffer[i].chord_ar, chords_array[current_chord]);
-        }
-    }
-}
-
-/* We want dynamically allocated chords in our chords_array. */
-void init_chords_array() 
-{
-    for (int i=0; i<DEFAULT_CHORDS; i++) {
-        int *new_chord = malloc(sizeof(int)*(MAX_CHORD_LEN+1));
-        copy_chord(new_chord, chords_array[i]); 
-        chords_array[i] = new_chord;
-    }
-}
-
-/* NOTE MANIPULATION */
-void invert_down(int *chord) 
-{
-    int highest=0;
-    int highest_i=255;
-    int *cur_note = chord;
-    int i = 0;
-    while (*cur_note != CHTERM) {
-        if (*cur_note > highest)  {
-            highest = *cur_note; 
-            highest_i = i;
-        } 
-        i++;
-        cur_note++;
-    }
-    chord[highest_i] -= 12;
-}
-
-void invert_up(int *chord) 
-{
-    int lowest=255;
-    int lowest_i=255;
-    int *cur_note = chord;
-    int i = 0;
-    while (*cur_note != CHTERM) {
-        if (*cur_note < lowest)  {
-            lowest = *cur_note; 
-            lowest_i = i;
-        } 
-        i++;
-        cur_note++;
-    }
-    chord[lowest_i] += 12;
-}
-
-void copy_chord(int *dest, int *source) 
-{
-    while ((*dest++=*source++)!=CHTERM) {} 
-}
-
+jack_port_t *output_ports[MAX_INSTANCES];
+jack_port_t *input_ports[MAX_INSTANCES];
+/* --cpus: where the process thread is pinned, or NULL to leave it be. */
+static char *cpu_list;
 
 /* USER INTERACTION CALLBACKS */
 
-uint8_t get_pkey_by_keycode(guint keycode) 
-{
-    for (int i=0; i<NUM_KEYS; i++) {
-        if (keycode == note_keycodes[i]) {
-            return i;
-        }
-    }
-    return 255;
-}
-
-uint8_t get_keypad_num_by_keycode(guint keycode)
-{
-    for (int i=0; i<10; i++) {
-        if (keycode == keypad_keycodes[i]) {
-            return i;
-        }
-    }
-    return 255; 
-}
-
-static void 
-handle_keypress_non_editing_mode(guint keyval, guint keycode, gpointer user_data)
-{
-    uint8_t pkey = get_pkey_by_keycode(keycode);
-    //debug("keyval: %d, keycode: %d\n", keyval, keycode);
-    if (pkey != 255 && key_state_buffer[pkey].pressed==0) {
-        key_state_buffer[pkey].chord = current_chord; 
-        key_state_buffer[pkey].pressed = 1;
-        key_state_buffer[pkey].midi_updated = 0;
-    } else {
-        uint8_t keypad_num = get_keypad_num_by_keycode(keycode);
-        int new_chord = 255;
-        if (keypad_num != 255) {
-            new_chord = keypad_num; 
-        } else if (keyval >= 48 && keyval < 58) {
-            new_chord = keyval - 48;
-        } else {
-            switch (keycode) { 
-                case 116: //arrow keys
-                new_chord = current_chord<4 ? 0 : current_chord-3;
-                break;
-                case 111:
-                new_chord = current_chord==0 ? 1 : 
-                    (current_chord<7 ? current_chord+3 : current_chord);
-                break;
-                case 113:
-                new_chord = (current_chord%3!=1 && current_chord) ? current_chord-1 
-                    : current_chord;
-                break;
-                case 114:
-                new_chord = current_chord%3!=0 ? current_chord+1 : current_chord;
-                break;
-                case 34: // open bracket
-                invert_down(chords_array[current_chord]); 
-                break;
-                case 35: // close bracket
-                invert_up(chords_array[current_chord]);
-                break;
-                case 20: // minus
-                base_note -= 12;
-                break;
-                case 21: // plus
-                base_note += 12;
-                break;
-            }
-        }
-        if (chords_array[new_chord]) {
-            gtk_widget_remove_css_class(widgets.labels[current_chord], "highlighted");
-            gtk_widget_add_css_class(widgets.labels[new_chord], "highlighted");
-            current_chord = new_chord;
-            update_key_state_buffer_new_chord();
-        } else {
-        }
-    }
-    gtk_widget_queue_draw (GTK_WIDGET(user_data));
-}
-
-void
-changed_cb (GObject* self, GParamSpec* pspec,
-    gpointer user_data)
-{
-    //printf("editing: %d LEditing: %d\n", editing, gtk_editable_label_get_editing(GTK_EDITABLE_LABEL(self)));
-    if (!gtk_editable_label_get_editing(GTK_EDITABLE_LABEL(self))) {
-        //printf("All done!\n");
-        gtk_event_controller_set_propagation_phase(widgets.window_event_controller,
-        GTK_PHASE_CAPTURE);
-        editing = 0;
-        gtk_editable_set_editable(GTK_EDITABLE(self), 0);
-        gtk_widget_remove_css_class(GTK_WIDGET(self), "inactive");
-        gtk_widget_add_css_class(GTK_WIDGET(self), "highlighted");
-        update_key_state_buffer_new_chord();
-    }
-}
-
-
-static void 
-leave_editing_mode()
-{
-    chords_array[current_chord][editing_i] = CHTERM;
-    editing = 2;
-    gtk_event_controller_set_propagation_phase(widgets.window_event_controller,
-    GTK_PHASE_TARGET);
-    GtkWidget *chord_label = widgets.labels[current_chord];
-    g_signal_connect(chord_label, "notify::editing", G_CALLBACK(changed_cb), NULL);
-    gtk_editable_set_editable(GTK_EDITABLE(chord_label), 1);
-    gtk_editable_label_start_editing(GTK_EDITABLE_LABEL(chord_label)); 
-}
-
-static void 
-handle_keypress_editing_mode(guint keyval, guint keycode, gpointer user_data)
-{
-    uint8_t pkey = get_pkey_by_keycode(keycode);
-    if (pkey != 255 && editing==1 && key_state_buffer[pkey].pressed==0) {
-        if (editing_i < MAX_CHORD_LEN) {
-            chords_array[current_chord][editing_i] = pkey;      
-            editing_i++;
-            key_state_buffer[pkey].pressed = 1;
-            // Don't send midi, because we just want to highlight the key.
-            key_state_buffer[pkey].midi_updated = 1;
-            gtk_widget_queue_draw (widgets.drawing_area);
-            debug("%d\n", editing_i);
-        }
-    } else {
-        if (keycode == 36 || keycode == 104 || keycode==24) {
-            if (editing==1) {
-                leave_editing_mode();
-            }
-        }
-    }
-}
-
 void 
 key_pressed_gcb(GtkEventControllerKey *controller,
                         guint keyval, guint keycode,  GdkModifierType state,
                           gpointer user_data)
 {
-    if (!editing) {
-        handle_keypress_non_editing_mode(keyval, keycode, user_data);
-    } else {
-        handle_keypress_editing_mode(keyval, keycode, user_data);
-    }
+    show_changes(engine_key_pressed(keyval, keycode));
 }
 
 void 
@@ -272,51 +38,31 @@ key_released_gcb(GtkEventControllerKey *controller,
                         guint keyval, guint keycode,  GdkModifierType state,
                           gpointer user_data)
 {
-    uint8_t pkey = get_pkey_by_keycode(keycode);
-    if (pkey != 255 && !editing) {
-        /* don't update .chord: we want to release the same chord we pressed */
-        key_state_buffer[pkey].pressed = 0;
-        key_state_buffer[pkey].midi_updated = 0;
-        key_state_buffer[pkey].chord_behind = 1;
-    } else if (pkey != 255) {
-        key_state_buffer[pkey].pressed = 0;
-        key_state_buffer[pkey].midi_updated = 1;
-    }
-    gtk_widget_queue_draw (GTK_WIDGET(user_data));
+    show_changes(engine_key_released(keyval, keycode));
 }
 
 void 
 click_on_chord_cb(GtkGestureClick *click, gint n_press,
     gdouble x, gdouble y, gpointer user_data)
 {
-    GtkWidget **label_pointer = (GtkWidget **) user_data;
-    ptrdiff_t new_chord = label_pointer-widgets.labels;
-    if (chords_array[new_chord]) {
-        gtk_widget_remove_css_class(widgets.labels[current_chord], "highlighted");
-        gtk_widget_add_css_class(widgets.labels[new_chord], "highlighted");
-        current_chord = new_chord;
-        update_key_state_buffer_new_chord();
-    }
+    guint slot = gtk_list_item_get_position(GTK_LIST_ITEM(user_data));
+    show_changes(engine_show_page(slot / NUM_CHORDS));
+    show_changes(engine_click_chord(slot % NUM_CHORDS));
 }
 
 void 
 edit_chord_cb(GtkGestureClick *click, gint n_press,
             gdouble x, gdouble y, gpointer user_data)
 {
+    guint slot = gtk_list_item_get_position(GTK_LIST_ITEM(user_data));
+    show_changes(engine_show_page(slot / NUM_CHORDS));
+    /* The page stays put while a chord is being recorded, and then the slot
+     * number would pick a chord on the wrong page. */
+    if (editing || active->page != (int) (slot / NUM_CHORDS)) {
+        return;
+    }
     printf("Play chord then press Enter.\n");
-    GtkWidget **label_pointer = (GtkWidget **) user_data;
-    ptrdiff_t chord_n = label_pointer-widgets.labels;
-    gtk_widget_remove_css_class(widgets.labels[current_chord], "highlighted");
-    current_chord = chord_n;
-    editing = 1;
-    editing_i = 0;
-    int *new_chord = malloc(sizeof(int)*(MAX_CHORD_LEN+1));
-    free(chords_array[chord_n]);
-    chords_array[chord_n] = new_chord;
-    /*
-    gtk_editable_set_editable(GTK_EDITABLE(*label_pointer), 1);
-    gtk_editable_label_start_editing(GTK_EDITABLE_LABEL(*label_pointer)); 
-    */
+    show_changes(engine_edit_chord(slot % NUM_CHORDS));
 }
 
 static void
@@ -329,8 +75,7 @@ close_window_cb (void)
 void 
 volume_changed_cb(GtkRange *range, gpointer user_data)
 {
-    volume = gtk_range_get_value(range);
-    printf("volume: %d\n", volume);
+    engine_set_volume(gtk_range_get_value(range));
 }
 
 void my_getsize(GtkWidget *widget, GtkAllocation *allocation, void *data) {
@@ -339,34 +84,72 @@ void my_getsize(GtkWidget *widget, GtkAllocation *allocation, void *data) {
 
 /* JACK CALLBACK */
 
-static int process_cb(jack_nframes_t nframes, void *arg)
+/* Feed the input port to the engine; only the sustain pedal is used. */
+static void 
+read_midi_input(struct lkey_instance *inst, void *in_buf)
+{
+    uint32_t count = jack_midi_get_event_count(in_buf);
+    for (uint32_t i=0; i<count; i++) {
+        jack_midi_event_t event;
+        if (jack_midi_event_get(&event, in_buf, i) == 0) {
+            engine_midi_input(inst, event.buffer, event.size);
+        }
+    }
+}
+
+/* Pass on everything written to port n this cycle, for the activity strip
+ * and the network output. */
+static void 
+publish_telemetry(int n, void *port_buf, jack_nframes_t cycle_start)
 {
-    void *port_buf = jack_port_get_buffer(output_port, nframes);
-    unsigned char* buffer;
-    jack_midi_clear_buffer(port_buf);
-    int chords_written = 0;
-    for (int pkey=0; pkey<NUM_KEYS; pkey++) {
-        if (key_state_buffer[pkey].midi_updated==0) {
-            //printf("playing pkey:%d\n", pkey);
-            uint8_t type = key_state_buffer[pkey].pressed ? 0x90 : 0x80;
-            int *nt = key_state_buffer[pkey].chord_ar;
-            while (*nt != CHTERM) {
-                buffer = jack_midi_event_reserve(port_buf, chords_written*3, 3);
-                buffer[0] = type;
-                buffer[1] = (unsigned char) base_note + pkey + *nt;
-                buffer[2] = volume;
-                nt++;
-                //printf("type=%d, freq=%d, vel=%d\n", buffer[0], buffer[1], buffer[2]);
-            }
-            key_state_buffer[pkey].midi_updated = 1;
-            // If this was a release, copy the new current chord to the key state buffer.
-            if (key_state_buffer[pkey].chord_behind) {
-                copy_chord(key_state_buffer[pkey].chord_ar, chords_array[current_chord]);
-                key_state_buffer[pkey].chord_behind = 0;
-            }
-            chords_written++;
+    uint32_t count = jack_midi_get_event_count(port_buf);
+    for (uint32_t i=0; i<count; i++) {
+        jack_midi_event_t event;
+        if (jack_midi_event_get(&event, port_buf, i) || event.size < 2) {
+            continue;
         }
+        netout_publish(&netout, event.time, n, event.buffer);
+        if (event.size == 3) {
+            telemetry_publish(&telemetry, cycle_start + event.time, n, event.buffer);
+        }
+    }
+}
+
+/* The grid quantized presses wait for. There is only one while transport
+ * is rolling and the timebase master gives bars and beats. */
+static void 
+query_transport(struct transport *transport)
+{
+    jack_position_t pos;
+    jack_transport_state_t state = jack_transport_query(client, &pos);
+    transport->rate = pos.frame_rate;
+    transport->rolling = state == JackTransportRolling && 
+        (pos.valid & JackPositionBBT) && pos.beats_per_minute > 0;
+    if (transport->rolling) {
+        transport->frames_per_beat = pos.frame_rate * 60.0 / pos.beats_per_minute;
+        transport->beat = (pos.bar - 1) * pos.beats_per_bar + (pos.beat - 1) + 
+            pos.tick / pos.ticks_per_beat;
+        transport->beat_type = pos.beat_type;
+    }
+}
+
+/* All instances share this callback; each writes to its own port. */
+static int process_cb(jack_nframes_t nframes, void *arg)
+{
+    jack_nframes_t cycle_start = jack_last_frame_time(client);
+    struct transport transport;
+    query_transport(&transport);
+    for (int n=0; n<num_instances; n++) {
+        void *port_buf = jack_port_get_buffer(output_ports[n], nframes);
+        void *in_buf = jack_port_get_buffer(input_ports[n], nframes);
+        struct midi_sink sink = { jack_midi_event_reserve, port_buf };
+        jack_midi_clear_buffer(port_buf);
+        read_midi_input(&instances[n], in_buf);
+        process_instance(&instances[n], &sink, nframes, &transport);
+        publish_telemetry(n, port_buf, cycle_start);
     }
+    telemetry_commit(&telemetry, cycle_start + nframes);
+    netout_commit(&netout, cycle_start);
     return 0;
 }
 
@@ -384,31 +167,148 @@ int start_app(int argc, char **argv)
 
 /* 
  * setup_jack:  Create the jack client, and register a "process callback" that can optionally
- * send midi events to the output port. Then activate the client.
+ * send midi events to the output ports. Then activate the client.
  * */
 int setup_jack()
 {
     if((client = jack_client_open("lkey", JackNullOption, NULL))==0) {
         fprintf(stderr, "JACK server not running?\n");
+        return 1;
     }
+    telemetry.rate = jack_get_sample_rate(client);
     jack_set_process_callback(client, process_cb, 0);
-    output_port = jack_port_register(client, "out", JACK_DEFAULT_MIDI_TYPE, 
-                                     JackPortIsOutput, 0);
+    jack_set_thread_init_callback(client, rt_thread_init, NULL);
+    for (int n=0; n<num_instances; n++) {
+        char out_name[16], in_name[16];
+        if (num_instances == 1) {
+            strcpy(out_name, "out");
+            strcpy(in_name, "in");
+        } else {
+            snprintf(out_name, sizeof(out_name), "out_%d", n+1);
+            snprintf(in_name, sizeof(in_name), "in_%d", n+1);
+        }
+        output_ports[n] = jack_port_register(client, out_name, JACK_DEFAULT_MIDI_TYPE, 
+                                             JackPortIsOutput, 0);
+        /* Input is only read for the sustain pedal. */
+        input_ports[n] = jack_port_register(client, in_name, JACK_DEFAULT_MIDI_TYPE, 
+                                            JackPortIsInput, 0);
+    }
+    /* Before activating, so not even the first cycle runs unlocked. */
+    rt_lock_memory();
     if (jack_activate(client)) {
         fprintf(stderr, "cannot activate client");
         return 1;
     }
+    if (rt_setup_thread(client)) {
+        jack_client_close(client);
+        client = NULL;
+        return 1;
+    }
     return 0;
 }
 
+static char *record_path;
+static char *replay_path;
+static char *expect_path;
+static char *midi_out_path;
+static int soak_seconds;
+static char *net_out;
+static int net_receive_port;
+static int net_drop;
+static char **bank_paths;
+
+static GOptionEntry option_entries[] =
+{
+  { "instances", 'n', 0, G_OPTION_ARG_INT, &num_instances, 
+    "Number of keyboards, each with its own output port (1-8)", "N" },
+  { "bank", 'b', 0, G_OPTION_ARG_FILENAME_ARRAY, &bank_paths, 
+    "Load a bank of chords into the library; can be given more than once", "FILE" },
+  { "record", 0, 0, G_OPTION_ARG_FILENAME, &record_path, 
+    "Record the session's key presses and clicks to FILE", "FILE" },
+  { "replay", 0, 0, G_OPTION_ARG_FILENAME, &replay_path, 
+    "Replay a recorded session without GTK or JACK, and time it", "FILE" },
+  { "expect", 0, 0, G_OPTION_ARG_FILENAME, &expect_path, 
+    "With --replay, fail unless the midi matches FILE byte for byte; FILE must "
+    "come from an earlier --replay --midi-out, not from the live run", "FILE" },
+  { "midi-out", 0, 0, G_OPTION_ARG_FILENAME, &midi_out_path, 
+    "With --replay, write the midi produced to FILE", "FILE" },
+  { "soak", 0, 0, G_OPTION_ARG_INT, &soak_seconds, 
+    "Run random key storms against the engine for SECONDS, without GTK or JACK, "
+    "and report stuck notes and other violations", "SECONDS" },
+  { "cpus", 0, 0, G_OPTION_ARG_STRING, &cpu_list, 
+    "Pin JACK's process thread to these cpus, e.g. 2,3 or 2-3", "LIST" },
+  { "net-out", 0, 0, G_OPTION_ARG_STRING, &net_out, 
+    "Also send the midi over UDP to HOST:PORT, one datagram per period", "HOST:PORT" },
+  { "net-receive", 0, 0, G_OPTION_ARG_INT, &net_receive_port, 
+    "Receive what --net-out sends to PORT, without GTK or JACK, and check its "
+    "order, losses and latency", "PORT" },
+  { "net-drop", 0, 0, G_OPTION_ARG_INT, &net_drop, 
+    "With --net-receive, throw away PERCENT of the datagrams to test recovery", 
+    "PERCENT" },
+  { NULL }
+};
+
 int main (int argc, char **argv)
 {
     int status;
-    init_chords_array();
-    init_key_state_buffer();
-    setup_jack();
-    update_key_state_buffer_new_chord();
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, option_entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(context);
+    if (replay_path) {
+        return replay_session(replay_path, expect_path, midi_out_path);
+    }
+    if (net_receive_port) {
+        return netout_receive(net_receive_port, net_drop);
+    }
+    if (num_instances < 1 || num_instances > MAX_INSTANCES) {
+        fprintf(stderr, "--instances must be between 1 and %d\n", MAX_INSTANCES);
+        return 1;
+    }
+    if (cpu_list && rt_set_cpus(cpu_list)) {
+        return 1;
+    }
+    for (int n=0; n<num_instances; n++) {
+        init_instance(&instances[n]);
+    }
+    /* Every instance starts with the same chords; the library needs them once. */
+    for (int i=0; i<NUM_CHORDS; i++) {
+        if (instances[0].chord_names[i]) {
+            library_add(instances[0].chord_names[i], instances[0].chords_array[i]);
+        }
+    }
+    for (int i=0; bank_paths && bank_paths[i]; i++) {
+        int added = library_load(bank_paths[i]);
+        if (added < 0) {
+            return 1;
+        }
+        printf("%s: %d chords\n", bank_paths[i], added);
+    }
+    if (record_path && record_open(record_path)) {
+        return 1;
+    }
+    if (net_out && netout_open(net_out)) {
+        return 1;
+    }
+    if (soak_seconds > 0) {
+        status = soak_run(soak_seconds);
+        netout_close();
+        record_close();
+        return status;
+    }
+    rt_prefault();
+    if (setup_jack()) {
+        netout_close();
+        record_close();
+        return 1;
+    }
     status = start_app(argc, argv);
+    netout_close();
+    rt_report_faults();
+    record_close();
     return status;
 }
-
@@ -1,10 +1,7 @@
 #ifndef __LKEY_H__
 #define __LKEY_H__
 
-#define NUM_KEYS 17
-#define MAX_CHORD_LEN 8
-
-void debug(char *format, ...);
+#include "engine.h"
 
 void 
 key_pressed_gcb(GtkEventControllerKey *controller,
@@ -27,14 +24,4 @@ edit_chord_cb(GtkGestureClick *click, gint n_press,
 void 
 volume_changed_cb(GtkRange *range, gpointer user_data);
 
-struct key_state
-{
-    uint8_t chord;
-    uint8_t pressed;
-    uint8_t midi_updated; 
-    uint8_t chord_behind;
-    int chord_ar[MAX_CHORD_LEN];
-};
-extern struct key_state key_state_buffer[NUM_KEYS];
-
 #endif
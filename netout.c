@@ -0,0 +1,809 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "engine.h"
+#include "netout.h"
+
+#define NETOUT_MASK (NETOUT_CYCLES - 1)
+#define NETOUT_EVENT_MASK (NETOUT_EVENTS - 1)
+
+/* A datagram, all numbers big endian:
+ *    0  'L' 'K' and the version
+ *    3  flags: NET_JOURNAL, NET_END
+ *    4  sequence number, 16 bits
+ *    6  event count, 16 bits
+ *    8  frame the cycle started at, 32 bits
+ *   12  when process_cb handed the cycle over, microseconds, 32 bits
+ *   16  the events: frames since the previous one (the first since the
+ *       cycle start) as a midi variable length number, the port, then the
+ *       message without running status
+ * then, with NET_JOURNAL, the notes on once these events have been played:
+ * a count, then for each port and channel with any on, port<<4 | channel,
+ * a 16 byte map of its notes (note n is bit n%8 of byte n/8) and the
+ * velocity of each note in the map, lowest first. The journal is the
+ * whole state, so one that arrives puts right any loss before it. */
+#define NET_HEADER 16
+#define NET_VERSION 1
+#define NET_JOURNAL 1
+#define NET_END 2
+
+/* After a cycle with events the journal goes out on its own NET_REPEATS
+ * more times, NET_REPEAT_MS apart, so a loss is put right even if nothing
+ * is played after it. While idle it is a heartbeat, every NET_HEARTBEAT_MS. */
+#define NET_REPEATS 3
+#define NET_REPEAT_MS 5
+#define NET_HEARTBEAT_MS 1000
+
+/* The receiver: seconds between reports, seconds of silence after which
+ * the sender is taken to have gone, 10 microsecond latency buckets, and
+ * how many of each kind of violation are printed in full. */
+#define NET_REPORT 10
+#define NET_IDLE 3
+#define NET_LATENCY_BUCKETS 10000
+#define MAX_REPORTED 10
+
+struct netout netout;
+
+/* Only touched by the sender thread, once it is running. velocity holds
+ * the notes on, as the journal describes them. */
+static struct
+{
+    int fd;
+    pthread_t thread;
+    _Atomic int running;
+    uint16_t seq;
+    uint32_t frame;
+    uint8_t velocity[MAX_INSTANCES][16][128];
+    /* The datagram being filled. */
+    uint8_t buf[NETOUT_DATAGRAM];
+    int used;
+    int count;
+    int flags;
+    uint16_t last;
+    long cycles;
+    long events;
+    long datagrams;
+    long bytes;
+    long errors;
+    long journals_too_big;
+    /* The cycle being sent, copied out of the queue and put in order. */
+    struct netout_event sorted[NETOUT_EVENTS];
+} sender;
+
+static int
+message_size(uint8_t status)
+{
+    return (status & 0xe0) == 0xc0 ? 2 : 3;
+}
+
+static uint32_t
+usec_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void
+put16(uint8_t *p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+static void
+put32(uint8_t *p, uint32_t value)
+{
+    put16(p, value >> 16);
+    put16(p+2, value);
+}
+
+static uint16_t
+get16(const uint8_t *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+static uint32_t
+get32(const uint8_t *p)
+{
+    return (uint32_t) get16(p) << 16 | get16(p+2);
+}
+
+/* THE RT SIDE */
+
+void
+netout_publish(struct netout *n, uint32_t time, int port, const unsigned char *data)
+{
+    if (!n->enabled) {
+        return;
+    }
+    /* A cycle is queued whole or not at all: one that's missing events
+     * would leave the receiver's notes wrong with no way to tell. */
+    if (n->pending == 0) {
+        n->full = n->written - atomic_load_explicit(&n->tail, memory_order_acquire)
+            >= NETOUT_CYCLES;
+    }
+    uint64_t index = n->events_written + n->pending++;
+    if (n->full || index - atomic_load_explicit(&n->events_read, memory_order_acquire)
+        >= NETOUT_EVENTS) {
+        n->full = 1;
+        return;
+    }
+    struct netout_event *event = &n->events[index & NETOUT_EVENT_MASK];
+    event->time = time;
+    event->port = port;
+    event->size = message_size(data[0]);
+    memcpy(event->data, data, event->size);
+}
+
+void
+netout_commit(struct netout *n, uint32_t frame)
+{
+    if (!n->enabled || n->pending == 0) {
+        return;
+    }
+    if (n->full) {
+        atomic_fetch_add_explicit(&n->dropped_cycles, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&n->dropped_events, n->pending, memory_order_relaxed);
+    } else {
+        struct netout_cycle *cycle = &n->cycles[n->written & NETOUT_MASK];
+        cycle->frame = frame;
+        cycle->sent = usec_now();
+        cycle->first = n->events_written;
+        cycle->count = n->pending;
+        n->events_written += n->pending;
+        n->written++;
+        atomic_store_explicit(&n->head, n->written, memory_order_release);
+        sem_post(&n->ready);
+    }
+    n->pending = 0;
+    n->full = 0;
+}
+
+/* THE SENDER THREAD */
+
+static void
+begin_datagram(void)
+{
+    sender.used = NET_HEADER;
+    sender.count = 0;
+    sender.flags = 0;
+    sender.last = 0;
+}
+
+static void
+send_datagram(uint32_t sent)
+{
+    uint8_t *p = sender.buf;
+    p[0] = 'L';
+    p[1] = 'K';
+    p[2] = NET_VERSION;
+    p[3] = sender.flags;
+    put16(p+4, sender.seq++);
+    put16(p+6, sender.count);
+    put32(p+8, sender.frame);
+    put32(p+12, sent);
+    /* Nobody listening yet is no reason to stop. */
+    if (send(sender.fd, p, sender.used, 0) < 0) {
+        sender.errors++;
+    } else {
+        sender.datagrams++;
+        sender.bytes += sender.used;
+    }
+    begin_datagram();
+}
+
+/* Returns 0 if the event doesn't fit in the datagram. */
+static int
+add_event(const struct netout_event *event)
+{
+    uint32_t delta = event->time - sender.last;
+    int delta_size = delta < 0x80 ? 1 : (delta < 0x4000 ? 2 : 3);
+    int size = event->size;
+    if (sender.used + delta_size + 1 + size > NETOUT_DATAGRAM) {
+        return 0;
+    }
+    uint8_t *p = sender.buf + sender.used;
+    for (int shift=7*(delta_size-1); shift>0; shift-=7) {
+        *p++ = 0x80 | ((delta >> shift) & 0x7f);
+    }
+    *p++ = delta & 0x7f;
+    *p++ = event->port;
+    memcpy(p, event->data, size);
+    sender.used = p + size - sender.buf;
+    sender.count++;
+    sender.last = event->time;
+
+    int status = event->data[0] & 0xf0;
+    uint8_t *velocity = 
+        &sender.velocity[event->port][event->data[0] & 0x0f][event->data[1] & 0x7f];
+    if (status == 0x90) {
+        *velocity = event->data[2];
+    } else if (status == 0x80) {
+        *velocity = 0;
+    }
+    return 1;
+}
+
+static int
+notes_on(const uint8_t *velocity)
+{
+    int count = 0;
+    for (int note=0; note<128; note++) {
+        count += velocity[note] != 0;
+    }
+    return count;
+}
+
+static int
+journal_size(void)
+{
+    int size = 1;
+    for (int port=0; port<MAX_INSTANCES; port++) {
+        for (int channel=0; channel<16; channel++) {
+            int count = notes_on(sender.velocity[port][channel]);
+            if (count) {
+                size += 1 + 16 + count;
+            }
+        }
+    }
+    return size;
+}
+
+static void
+add_journal(void)
+{
+    uint8_t *p = sender.buf + sender.used;
+    uint8_t *entries = p++;
+    *entries = 0;
+    for (int port=0; port<MAX_INSTANCES; port++) {
+        for (int channel=0; channel<16; channel++) {
+            const uint8_t *velocity = sender.velocity[port][channel];
+            if (!notes_on(velocity)) {
+                continue;
+            }
+            (*entries)++;
+            *p++ = port << 4 | channel;
+            uint8_t *map = p;
+            memset(map, 0, 16);
+            p += 16;
+            for (int note=0; note<128; note++) {
+                if (velocity[note]) {
+                    map[note/8] |= 1 << note%8;
+                    *p++ = velocity[note];
+                }
+            }
+        }
+    }
+    sender.used = p - sender.buf;
+    sender.flags |= NET_JOURNAL;
+}
+
+/* Send the datagram being filled, with the journal if it fits, or if not
+ * the journal in a datagram of its own. */
+static void
+finish_with_journal(uint32_t sent, int flags)
+{
+    int size = journal_size();
+    if (sender.used + size > NETOUT_DATAGRAM && sender.count) {
+        send_datagram(sent);
+    }
+    if (sender.used + size <= NETOUT_DATAGRAM) {
+        add_journal();
+    } else {
+        sender.journals_too_big++;
+    }
+    sender.flags |= flags;
+    send_datagram(sent);
+}
+
+/* Ports are written one after another, so the cycle's events are put in
+ * time order first, keeping each port's own order. Their room in the queue
+ * is given back as soon as they are copied. */
+static void
+send_cycle(const struct netout_cycle *cycle)
+{
+    struct netout_event *events = sender.sorted;
+    for (int i=0; i<cycle->count; i++) {
+        events[i] = netout.events[(cycle->first + i) & NETOUT_EVENT_MASK];
+    }
+    atomic_store_explicit(&netout.events_read, cycle->first + cycle->count,
+                          memory_order_release);
+    for (int i=1; i<cycle->count; i++) {
+        struct netout_event event = events[i];
+        int j = i;
+        for (; j > 0 && events[j-1].time > event.time; j--) {
+            events[j] = events[j-1];
+        }
+        events[j] = event;
+    }
+    sender.frame = cycle->frame;
+    for (int i=0; i<cycle->count; i++) {
+        if (!add_event(&events[i])) {
+            send_datagram(cycle->sent);
+            add_event(&events[i]);
+        }
+    }
+    finish_with_journal(cycle->sent, 0);
+    sender.cycles++;
+    sender.events += cycle->count;
+}
+
+static void *
+sender_thread(void *arg)
+{
+    int repeats = 0;
+    struct timespec last;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    for (;;) {
+        uint64_t tail = atomic_load_explicit(&netout.tail, memory_order_relaxed);
+        if (tail < atomic_load_explicit(&netout.head, memory_order_acquire)) {
+            send_cycle(&netout.cycles[tail & NETOUT_MASK]);
+            atomic_store_explicit(&netout.tail, tail + 1, memory_order_release);
+            repeats = NET_REPEATS;
+        } else if (!atomic_load(&sender.running)) {
+            break;
+        } else {
+            struct timespec deadline = last;
+            long long nsec = deadline.tv_nsec +
+                1000000LL * (repeats ? NET_REPEAT_MS : NET_HEARTBEAT_MS);
+            deadline.tv_sec += nsec / 1000000000;
+            deadline.tv_nsec = nsec % 1000000000;
+            if (sem_clockwait(&netout.ready, CLOCK_MONOTONIC, &deadline) == 0 ||
+                errno != ETIMEDOUT) {
+                continue;
+            }
+            finish_with_journal(usec_now(), 0);
+            if (repeats) {
+                repeats--;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &last);
+    }
+    finish_with_journal(usec_now(), NET_END);
+    return NULL;
+}
+
+int
+netout_open(const char *dest)
+{
+    char host[256];
+    const char *colon = strrchr(dest, ':');
+    size_t length = colon ? colon - dest : 0;
+    if (!colon || !length || length >= sizeof(host) || !colon[1]) {
+        fprintf(stderr, "lkey: --net-out wants HOST:PORT, not \"%s\"\n", dest);
+        return 1;
+    }
+    /* [::1]:5004 for IPv6 addresses. */
+    if (dest[0] == '[' && dest[length-1] == ']') {
+        dest++;
+        length -= 2;
+    }
+    memcpy(host, dest, length);
+    host[length] = '\0';
+
+    struct addrinfo hints = {0}, *addrs;
+    hints.ai_socktype = SOCK_DGRAM;
+    int err = getaddrinfo(host, colon+1, &hints, &addrs);
+    if (err) {
+        fprintf(stderr, "lkey: cannot resolve %s (%s)\n", host, gai_strerror(err));
+        return 1;
+    }
+    sender.fd = -1;
+    for (struct addrinfo *a=addrs; a && sender.fd < 0; a=a->ai_next) {
+        sender.fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (sender.fd >= 0 && connect(sender.fd, a->ai_addr, a->ai_addrlen)) {
+            close(sender.fd);
+            sender.fd = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+    if (sender.fd < 0) {
+        fprintf(stderr, "lkey: cannot send to %s:%s (%s)\n", host, colon+1,
+                strerror(errno));
+        return 1;
+    }
+    sem_init(&netout.ready, 0, 0);
+    begin_datagram();
+    atomic_store(&sender.running, 1);
+    netout.enabled = 1;
+    pthread_create(&sender.thread, NULL, sender_thread, NULL);
+    printf("lkey: sending midi to %s:%s\n", host, colon+1);
+    return 0;
+}
+
+void
+netout_close(void)
+{
+    if (!netout.enabled) {
+        return;
+    }
+    atomic_store(&sender.running, 0);
+    sem_post(&netout.ready);
+    pthread_join(sender.thread, NULL);
+    close(sender.fd);
+    printf("lkey: sent %ld midi events from %ld cycles in %ld datagrams, %ld bytes\n",
+           sender.events, sender.cycles, sender.datagrams, sender.bytes);
+    if (atomic_load(&netout.dropped_cycles) || atomic_load(&netout.dropped_events)) {
+        printf("lkey: %ld cycles and %ld events didn't fit in the network queue\n",
+               atomic_load(&netout.dropped_cycles), atomic_load(&netout.dropped_events));
+    }
+    if (sender.errors) {
+        printf("lkey: %ld datagrams couldn't be sent\n", sender.errors);
+    }
+    if (sender.journals_too_big) {
+        printf("lkey: %ld journals were too big for a datagram\n", sender.journals_too_big);
+    }
+}
+
+/* THE RECEIVER */
+
+enum net_violation
+{
+    NV_MALFORMED, NV_ORDER, NV_DOUBLE_ON, NV_STRAY_OFF, NV_JOURNAL, NV_STUCK,
+    NUM_NET_VIOLATIONS
+};
+static const char *net_violation_names[NUM_NET_VIOLATIONS] = {"malformed datagram",
+    "time went backwards", "note-on while on", "note-off while off",
+    "journal disagrees", "stuck note"};
+
+/* velocity holds the notes on, as the events received have left them.
+ * unsynced is set from a loss until a journal puts it right; meanwhile
+ * notes may well look wrong. */
+static struct
+{
+    uint8_t velocity[MAX_INSTANCES][16][128];
+    uint8_t journal[MAX_INSTANCES][16][128];
+    struct timespec start;
+    uint16_t expected;
+    uint32_t time;
+    int unsynced;
+    int ended;
+    long datagrams;
+    long events;
+    long lost;
+    long late;
+    long dropped;
+    long recovered;
+    long violations[NUM_NET_VIOLATIONS];
+    long latencies;
+    uint32_t latency_min;
+    uint32_t latency_max;
+    double latency_sum;
+    long latency_buckets[NET_LATENCY_BUCKETS + 1];
+} receiver;
+
+static double
+seconds_since_start(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - receiver.start.tv_sec) +
+        (now.tv_nsec - receiver.start.tv_nsec)/1e9;
+}
+
+static void
+net_violation(enum net_violation v, const char *format, ...)
+{
+    if (receiver.violations[v]++ >= MAX_REPORTED) {
+        return;
+    }
+    printf("net: %.3fs: %s: ", seconds_since_start(), net_violation_names[v]);
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    putchar('\n');
+}
+
+static void
+add_latency(uint32_t latency)
+{
+    if (receiver.latencies == 0 || latency < receiver.latency_min) {
+        receiver.latency_min = latency;
+    }
+    if (latency > receiver.latency_max) {
+        receiver.latency_max = latency;
+    }
+    receiver.latency_sum += latency;
+    receiver.latencies++;
+    uint32_t bucket = latency / 10;
+    receiver.latency_buckets[bucket < NET_LATENCY_BUCKETS ? bucket : NET_LATENCY_BUCKETS]++;
+}
+
+static uint32_t
+latency_percentile(double fraction)
+{
+    long seen = 0;
+    for (int bucket=0; bucket<NET_LATENCY_BUCKETS; bucket++) {
+        seen += receiver.latency_buckets[bucket];
+        if (seen >= fraction * receiver.latencies) {
+            return (bucket + 1) * 10;
+        }
+    }
+    return receiver.latency_max;
+}
+
+static void
+play_event(int port, const uint8_t *data)
+{
+    int status = data[0] & 0xf0;
+    int channel = data[0] & 0x0f;
+    uint8_t *velocity = &receiver.velocity[port][channel][data[1] & 0x7f];
+    if (status == 0x90 && data[2]) {
+        if (*velocity && !receiver.unsynced) {
+            net_violation(NV_DOUBLE_ON, "port %d channel %d: note %d", port+1,
+                          channel+1, data[1]);
+        }
+        *velocity = data[2];
+    } else if (status == 0x80 || status == 0x90) {
+        if (!*velocity && !receiver.unsynced) {
+            net_violation(NV_STRAY_OFF, "port %d channel %d: note %d", port+1,
+                          channel+1, data[1]);
+        }
+        *velocity = 0;
+    }
+}
+
+/* Returns 0 if the journal doesn't parse. */
+static int
+read_journal(const uint8_t *p, const uint8_t *end)
+{
+    memset(receiver.journal, 0, sizeof(receiver.journal));
+    if (p == end) {
+        return 0;
+    }
+    int entries = *p++;
+    for (int e=0; e<entries; e++) {
+        if (end - p < 17 || (*p >> 4) >= MAX_INSTANCES) {
+            return 0;
+        }
+        uint8_t *velocity = receiver.journal[*p >> 4][*p & 0x0f];
+        const uint8_t *map = p + 1;
+        p += 17;
+        for (int note=0; note<128; note++) {
+            if (map[note/8] & 1 << note%8) {
+                if (p == end || *p == 0 || *p > 127) {
+                    return 0;
+                }
+                velocity[note] = *p++;
+            }
+        }
+    }
+    return p == end;
+}
+
+/* Make the notes on what the journal says. Without a loss since the last
+ * journal any difference is a bug; after one, the difference is what was
+ * lost, and the notes it puts on or off are counted as recovered. */
+static void
+apply_journal(void)
+{
+    for (int port=0; port<MAX_INSTANCES; port++) {
+        for (int channel=0; channel<16; channel++) {
+            for (int note=0; note<128; note++) {
+                uint8_t *velocity = &receiver.velocity[port][channel][note];
+                uint8_t should = receiver.journal[port][channel][note];
+                if (!*velocity == !should) {
+                    continue;
+                }
+                if (receiver.unsynced) {
+                    receiver.recovered++;
+                } else {
+                    net_violation(NV_JOURNAL, "port %d channel %d: note %d should be %s",
+                                  port+1, channel+1, note, should ? "on" : "off");
+                }
+                *velocity = should;
+            }
+        }
+    }
+    receiver.unsynced = 0;
+}
+
+static void
+receive_datagram(const uint8_t *p, int size)
+{
+    const uint8_t *end = p + size;
+    if (size < NET_HEADER || p[0] != 'L' || p[1] != 'K' || p[2] != NET_VERSION) {
+        net_violation(NV_MALFORMED, "%d bytes", size);
+        return;
+    }
+    uint16_t seq = get16(p+4);
+    if (receiver.datagrams) {
+        int16_t ahead = seq - receiver.expected;
+        /* Late or repeated: what it carried has been journalled since. */
+        if (ahead < 0) {
+            receiver.late++;
+            return;
+        }
+        if (ahead > 0) {
+            receiver.lost += ahead;
+            receiver.unsynced = 1;
+        }
+    }
+    receiver.expected = seq + 1;
+    receiver.datagrams++;
+
+    int flags = p[3];
+    int count = get16(p+6);
+    uint32_t time = get32(p+8);
+    if (count) {
+        add_latency(usec_now() - get32(p+12));
+    }
+    p += NET_HEADER;
+    for (int i=0; i<count; i++) {
+        uint32_t delta = 0;
+        do {
+            if (p == end) {
+                net_violation(NV_MALFORMED, "datagram %d: event %d of %d", seq, i, count);
+                return;
+            }
+            delta = delta << 7 | (*p & 0x7f);
+        } while (*p++ & 0x80);
+        if (end - p < 2 || *p >= MAX_INSTANCES || end - p - 1 < message_size(p[1])) {
+            net_violation(NV_MALFORMED, "datagram %d: event %d of %d", seq, i, count);
+            return;
+        }
+        int port = *p++;
+        time += delta;
+        if (receiver.events && (int32_t) (time - receiver.time) < 0) {
+            net_violation(NV_ORDER, "frame %u after %u", time, receiver.time);
+        }
+        receiver.time = time;
+        receiver.events++;
+        play_event(port, p);
+        p += message_size(p[0]);
+    }
+    if (flags & NET_JOURNAL) {
+        if (read_journal(p, end)) {
+            apply_journal();
+        } else {
+            net_violation(NV_MALFORMED, "datagram %d: journal", seq);
+        }
+    }
+    if (flags & NET_END) {
+        receiver.ended = 1;
+    }
+}
+
+static long
+total_net_violations(void)
+{
+    long total = 0;
+    for (int v=0; v<NUM_NET_VIOLATIONS; v++) {
+        total += receiver.violations[v];
+    }
+    return total;
+}
+
+static void
+net_report(double elapsed)
+{
+    printf("net: %6.0fs  %ld datagrams  %ld midi events  %ld lost  %ld late  "
+           "%ld notes recovered  %ld violations\n", elapsed, receiver.datagrams,
+           receiver.events, receiver.lost, receiver.late, receiver.recovered,
+           total_net_violations());
+    if (receiver.latencies) {
+        printf("net: latency %uus min, %.0fus mean, %uus 99th percentile, %uus max\n",
+               receiver.latency_min, receiver.latency_sum / receiver.latencies,
+               latency_percentile(0.99), receiver.latency_max);
+    }
+    fflush(stdout);
+}
+
+/* Listen on IPv6 and IPv4 both, where there is IPv6. */
+static int
+listen_on(int port)
+{
+    int fd = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (fd >= 0) {
+        int off = 0;
+        struct sockaddr_in6 addr = {0};
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_any;
+        addr.sin6_port = htons(port);
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+    }
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd >= 0) {
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+int
+netout_receive(int port, int drop)
+{
+    int fd = listen_on(port);
+    if (fd < 0) {
+        fprintf(stderr, "lkey: cannot listen on port %d (%s)\n", port, strerror(errno));
+        return 1;
+    }
+    struct timeval timeout = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    unsigned seed = time(NULL);
+    printf("net: listening on port %d", port);
+    if (drop > 0) {
+        printf(", dropping %d%% of datagrams, seed %u", drop, seed);
+    }
+    printf("\n");
+    fflush(stdout);
+
+    static uint8_t buf[65536];
+    double heard = 0, reported = 0, now = 0;
+    clock_gettime(CLOCK_MONOTONIC, &receiver.start);
+    while (!receiver.ended) {
+        ssize_t size = recv(fd, buf, sizeof(buf), 0);
+        now = seconds_since_start();
+        if (size >= 0) {
+            heard = now;
+            if (drop > 0 && (int) (rand_r(&seed) % 100) < drop) {
+                receiver.dropped++;
+            } else {
+                receive_datagram(buf, size);
+            }
+        } else if (errno != EAGAIN && errno != EINTR) {
+            fprintf(stderr, "lkey: cannot receive (%s)\n", strerror(errno));
+            break;
+        }
+        if (receiver.datagrams && now - heard >= NET_IDLE) {
+            printf("net: nothing for %d seconds\n", NET_IDLE);
+            break;
+        }
+        if (now - reported >= NET_REPORT) {
+            net_report(now);
+            reported = now;
+        }
+    }
+    close(fd);
+
+    if (!receiver.unsynced) {
+        for (int p=0; p<MAX_INSTANCES; p++) {
+            for (int channel=0; channel<16; channel++) {
+                for (int note=0; note<128; note++) {
+                    if (receiver.velocity[p][channel][note]) {
+                        net_violation(NV_STUCK, "port %d channel %d: note %d", p+1,
+                                      channel+1, note);
+                    }
+                }
+            }
+        }
+    }
+    net_report(now);
+    if (receiver.dropped) {
+        printf("  %-20s %ld\n", "dropped on purpose", receiver.dropped);
+    }
+    for (int v=0; v<NUM_NET_VIOLATIONS; v++) {
+        if (receiver.violations[v]) {
+            printf("  %-20s %ld\n", net_violation_names[v], receiver.violations[v]);
+        }
+    }
+    if (receiver.unsynced) {
+        printf("net: the last loss was never put right\n");
+    }
+    return total_net_violations() != 0 || receiver.unsynced;
+}
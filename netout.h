@@ -0,0 +1,82 @@
+#ifndef __NETOUT_H__
+#define __NETOUT_H__
+
+#include <stdint.h>
+#include <semaphore.h>
+
+/* Cycles and events the queue holds, powers of two. Even a cycle with
+ * every port as full as JACK allows fits, as long as the sender keeps up. */
+#define NETOUT_CYCLES 256
+#define NETOUT_EVENTS 32768
+/* Largest datagram, so it fits an ethernet frame without fragmenting. */
+#define NETOUT_DATAGRAM 1400
+
+/* One event written to a port, time in frames from the start of its cycle,
+ * and its length: 2 for program change and channel pressure, otherwise 3. */
+struct netout_event
+{
+    uint16_t time;
+    uint8_t port;
+    uint8_t size;
+    uint8_t data[3];
+};
+
+/* Everything one cycle sent: the frame it started at, when process_cb was
+ * done with it (microseconds, CLOCK_MONOTONIC), and where its events are. */
+struct netout_cycle
+{
+    uint32_t frame;
+    uint32_t sent;
+    uint64_t first;
+    int count;
+};
+
+/* The midi process_cb sends, passed on to the sender thread. Like the
+ * telemetry ring there is one writer, process_cb, and one reader; unlike
+ * it the writer never overwrites, but drops whole cycles while the queue
+ * is full. Only cycles with events are queued, and the sender is woken 
+ * with sem_post, which doesn't block. */
+struct netout
+{
+    int enabled;
+    struct netout_cycle cycles[NETOUT_CYCLES];
+    struct netout_event events[NETOUT_EVENTS];
+    /* Cycles published by process_cb, then cycles and events the sender is
+     * done with. */
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    _Atomic uint64_t events_read;
+    sem_t ready;
+    /* Only touched by process_cb: its own copies of head and of the events
+     * published, the events of the cycle so far, and whether any of them 
+     * didn't fit. */
+    uint64_t written;
+    uint64_t events_written;
+    int pending;
+    int full;
+    _Atomic long dropped_cycles;
+    _Atomic long dropped_events;
+};
+extern struct netout netout;
+
+/* Send to dest, "host:port", from a thread of its own. Returns nonzero if
+ * dest can't be resolved or the socket can't be opened. */
+int netout_open(const char *dest);
+/* Send what is still queued, stop the thread and print what was sent. */
+void netout_close(void);
+/* process_cb: add one event, then hand over the cycle at its end. Both do
+ * nothing unless netout_open succeeded. */
+void netout_publish(struct netout *n, uint32_t time, int port,
+                    const unsigned char *data);
+void netout_commit(struct netout *n, uint32_t frame);
+
+/* The bundled receiver: listen on port, checking the datagrams for order,
+ * loss, note consistency and latency (measured against the sender's clock,
+ * so only meaningful on the same machine), recovering from losses with the
+ * journal. drop is a percentage of datagrams to throw away on arrival, to
+ * exercise recovery on localhost. Reports every few seconds, and returns
+ * once the sender has been silent for a while: nonzero if anything went
+ * wrong that the journal didn't put right. */
+int netout_receive(int port, int drop);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef __NOTESET_H__
+#define __NOTESET_H__
+
+#include <stdint.h>
+
+/* A set of midi notes, one bit per note number. */
+typedef struct { uint64_t w[2]; } noteset_t;
+
+static inline int 
+noteset_has(const noteset_t *set, int note)
+{
+    return (set->w[note >> 6] >> (note & 63)) & 1;
+}
+
+static inline void 
+noteset_add(noteset_t *set, int note)
+{
+    set->w[note >> 6] |= (uint64_t) 1 << (note & 63);
+}
+
+static inline void 
+noteset_remove(noteset_t *set, int note)
+{
+    set->w[note >> 6] &= ~((uint64_t) 1 << (note & 63));
+}
+
+static inline int 
+noteset_empty(const noteset_t *set)
+{
+    return !(set->w[0] | set->w[1]);
+}
+
+/* Remove and return the lowest note in set, or -1 if it is empty. */
+static inline int 
+noteset_pop(noteset_t *set)
+{
+    for (int i=0; i<2; i++) {
+        if (set->w[i]) {
+            int note = i*64 + __builtin_ctzll(set->w[i]);
+            set->w[i] &= set->w[i] - 1;
+            return note;
+        }
+    }
+    return -1;
+}
+
+#endif
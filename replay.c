@@ -0,0 +1,425 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "engine.h"
+#include "replay.h"
+
+/* After the last event, run another second's worth of cycles so everything
+ * the session started gets out. */
+#define REPLAY_TAIL (REPLAY_RATE / REPLAY_PERIOD)
+
+enum event_kind 
+{
+    EV_PRESS, EV_RELEASE, EV_CLICK, EV_EDIT, EV_NAME, EV_VOLUME, EV_HARMONY,
+    EV_LATCH, EV_LIVE, EV_PANIC, EV_INSTANCE, EV_QUANTIZE, EV_ASSIGN, 
+    EV_ZONE, EV_PROGRESSION, EV_SEQUENCER, EV_EXPRESSION, EV_VERTICAL, EV_PAGE,
+    EV_FOLLOW, NUM_EVENT_KINDS
+};
+static const char *event_kinds[NUM_EVENT_KINDS] = {"press", "release", "click", 
+    "edit", "name", "volume", "harmony", "latch", "live", "panic", "instance", 
+    "quantize", "assign", "zone", "progression", "sequencer", "expression", 
+    "vertical", "page", "follow"};
+
+/* Nanoseconds spent on one kind of work. */
+struct cost
+{
+    long count;
+    long long total;
+    long long min;
+    long long max;
+};
+
+struct replay
+{
+    FILE *out;
+    uint64_t cycle;
+    long midi_events;
+    struct cost events[NUM_EVENT_KINDS];
+    struct cost idle_cycles;
+    struct cost midi_cycles;
+    struct loopback ports[MAX_INSTANCES];
+};
+
+static FILE *record_file;
+static struct timespec record_start;
+static struct replay replay;
+
+static long long
+nsec_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000000LL + now.tv_nsec;
+}
+
+/* RECORDING */
+
+int 
+record_open(const char *path)
+{
+    record_file = fopen(path, "w");
+    if (!record_file) {
+        perror(path);
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &record_start);
+    fprintf(record_file, "instances %d\n", num_instances);
+    return 0;
+}
+
+void 
+record_close(void)
+{
+    if (record_file) {
+        fclose(record_file);
+        record_file = NULL;
+    }
+}
+
+/* Each line is flushed as it's written, so a session that ends in a crash 
+ * is still there to replay. */
+void 
+record_event(const char *format, ...)
+{
+    if (!record_file) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long usec = (now.tv_sec - record_start.tv_sec)*1000000LL + 
+        (now.tv_nsec - record_start.tv_nsec)/1000;
+    fprintf(record_file, "%lld ", usec);
+    va_list args;
+    va_start(args, format);
+    vfprintf(record_file, format, args);
+    va_end(args);
+    fputc('\n', record_file);
+    fflush(record_file);
+}
+
+/* REPLAY */
+
+unsigned char *
+loopback_reserve(void *buf, uint32_t time, size_t size)
+{
+    struct loopback *port = buf;
+    if (size > 3 || time >= REPLAY_PERIOD || port->count == LOOPBACK_EVENTS ||
+        (port->count && time < port->time[port->count-1])) {
+        port->dropped++;
+        return NULL;
+    }
+    port->time[port->count] = time;
+    memset(port->data[port->count], 0, 3);
+    return port->data[port->count++];
+}
+
+void
+virtual_transport(struct transport *transport, uint64_t frame)
+{
+    transport->rolling = 1;
+    transport->frames_per_beat = REPLAY_RATE * 60.0 / 120;
+    transport->beat = frame / transport->frames_per_beat;
+    transport->beat_type = 4;
+    transport->rate = REPLAY_RATE;
+}
+
+static void
+cost_add(struct cost *cost, long long nsec)
+{
+    if (!cost->count || nsec < cost->min) {
+        cost->min = nsec;
+    }
+    if (nsec > cost->max) {
+        cost->max = nsec;
+    }
+    cost->total += nsec;
+    cost->count++;
+}
+
+static void
+print_cost(const char *name, const struct cost *cost)
+{
+    if (!cost->count) {
+        return;
+    }
+    printf("  %-12s %8ld  mean %8.2f us  min %8.2f us  max %8.2f us\n", name, 
+           cost->count, cost->total/1000.0/cost->count, cost->min/1000.0, 
+           cost->max/1000.0);
+}
+
+/* One process_cb: every instance writes to its own loopback port, and what 
+ * they wrote is printed one event per line as "frame port status data data". */
+static void
+run_cycle(void)
+{
+    struct transport transport;
+    virtual_transport(&transport, replay.cycle*REPLAY_PERIOD);
+    long long start = nsec_now();
+    for (int n=0; n<num_instances; n++) {
+        struct midi_sink sink = { loopback_reserve, &replay.ports[n] };
+        replay.ports[n].count = 0;
+        process_instance(&instances[n], &sink, REPLAY_PERIOD, &transport);
+    }
+    long long nsec = nsec_now() - start;
+
+    int written = 0;
+    for (int n=0; n<num_instances; n++) {
+        struct loopback *port = &replay.ports[n];
+        for (int i=0; i<port->count; i++) {
+            fprintf(replay.out, "%llu %d %02x %02x %02x\n", 
+                    (unsigned long long) replay.cycle*REPLAY_PERIOD + port->time[i], 
+                    n+1, port->data[i][0], port->data[i][1], port->data[i][2]);
+        }
+        written += port->count;
+    }
+    replay.midi_events += written;
+    cost_add(written ? &replay.midi_cycles : &replay.idle_cycles, nsec);
+    replay.cycle++;
+}
+
+/* Apply one recorded event, without its time. Returns nonzero if it makes 
+ * no sense. */
+static int
+replay_event(const char *event)
+{
+    char kind[16];
+    int n = 0;
+    int a = 0, b = 0, c = 0;
+    int zone[8] = {0};
+    if (sscanf(event, "%15s %n", kind, &n) != 1) {
+        return 1;
+    }
+    const char *args = event + n;
+    int k = 0;
+    while (k < NUM_EVENT_KINDS && strcmp(kind, event_kinds[k])) {
+        k++;
+    }
+    if (k == NUM_EVENT_KINDS) {
+        return 1;
+    }
+    sscanf(args, "%d %d %d", &a, &b, &c);
+    if (k == EV_ZONE && sscanf(args, "%d %d %d %d %d %d %d %d", &zone[0], &zone[1],
+                               &zone[2], &zone[3], &zone[4], &zone[5], &zone[6], 
+                               &zone[7]) != 8) {
+        return 1;
+    }
+    if ((k == EV_CLICK || k == EV_EDIT || k == EV_ASSIGN) && (a < 0 || a >= NUM_CHORDS)) {
+        return 1;
+    }
+    if (k == EV_FOLLOW && (a < 0 || a >= num_instances || b < 0 || b >= NUM_CHORDS)) {
+        return 1;
+    }
+    /* assign n notes name, the notes comma separated or "-" for none. */
+    int notes[MAX_CHORD_LEN + 1];
+    const char *name = NULL;
+    if (k == EV_ASSIGN) {
+        int len = 0, used = 0;
+        const char *p;
+        if (sscanf(args, "%*d %n", &used) < 0 || !used) {
+            return 1;
+        }
+        p = args + used;
+        if (*p == '-') {
+            p++;
+        } else {
+            while (len < MAX_CHORD_LEN && sscanf(p, "%d%n", &notes[len], &used) == 1) {
+                len++;
+                p += used;
+                if (*p == ',') {
+                    p++;
+                }
+            }
+        }
+        notes[len] = CHTERM;
+        if (*p != ' ') {
+            return 1;
+        }
+        name = p + 1;
+    }
+
+    /* progression n chord:inversion:beats ... */
+    struct progression_step steps[MAX_STEPS];
+    if (k == EV_PROGRESSION) {
+        const char *p = args;
+        int used = 0;
+        if (sscanf(p, "%d%n", &a, &used) != 1 || a < 0 || a > MAX_STEPS) {
+            return 1;
+        }
+        p += used;
+        for (int i=0; i<a; i++) {
+            if (sscanf(p, " %d:%d:%lf%n", &steps[i].chord, &steps[i].inversion, 
+                       &steps[i].beats, &used) != 3) {
+                return 1;
+            }
+            p += used;
+        }
+    }
+
+    long long start = nsec_now();
+    switch (k) {
+        case EV_PRESS: engine_key_pressed(a, b); break;
+        case EV_RELEASE: engine_key_released(a, b); break;
+        case EV_CLICK: engine_click_chord(a); break;
+        case EV_EDIT: engine_edit_chord(a); break;
+        case EV_NAME: engine_name_chord(args); break;
+        case EV_VOLUME: engine_set_volume(a); break;
+        case EV_HARMONY: engine_set_harmony(a, b, c); break;
+        case EV_LATCH: engine_set_latch(a); break;
+        case EV_LIVE: engine_set_live(a); break;
+        case EV_PANIC: engine_panic(); break;
+        case EV_INSTANCE: engine_switch_instance(a); break;
+        case EV_QUANTIZE: engine_set_quantize(a, b); break;
+        case EV_ASSIGN: engine_assign_chord(a, notes, name); break;
+        case EV_PROGRESSION: engine_set_progression(steps, a); break;
+        case EV_SEQUENCER: engine_set_sequencer(a, b); break;
+        case EV_EXPRESSION: engine_set_expression(a, b); break;
+        case EV_VERTICAL: engine_set_vertical(a, b); break;
+        case EV_PAGE: engine_show_page(a); break;
+        case EV_FOLLOW: engine_follow_chord(a, b); break;
+        case EV_ZONE: engine_set_zone(zone[0], zone[1], zone[2], zone[3], zone[4], 
+                                      zone[5], zone[6], zone[7]); break;
+    }
+    cost_add(&replay.events[k], nsec_now() - start);
+    return 0;
+}
+
+/* Each event is picked up by the first cycle that starts after it, as it 
+ * would be under JACK. */
+static int
+replay_event_at(long long usec, const char *event)
+{
+    if (usec < 0) {
+        return 1;
+    }
+    uint64_t frame = usec * REPLAY_RATE / 1000000;
+    while (replay.cycle*REPLAY_PERIOD < frame) {
+        run_cycle();
+    }
+    return replay_event(event);
+}
+
+static char *
+read_file(const char *path, size_t *len)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *contents = malloc(size + 1);
+    *len = fread(contents, 1, size, file);
+    contents[*len] = 0;
+    fclose(file);
+    return contents;
+}
+
+/* Byte for byte; on a difference, show the first line that differs. */
+static int
+compare_midi(const char *expect_path, const char *midi, size_t len)
+{
+    size_t expected_len;
+    char *expected = read_file(expect_path, &expected_len);
+    if (!expected) {
+        return 1;
+    }
+    if (expected_len == len && memcmp(expected, midi, len) == 0) {
+        printf("midi matches %s\n", expect_path);
+        free(expected);
+        return 0;
+    }
+    size_t line_start = 0;
+    int line = 1;
+    for (size_t i=0; i<len && i<expected_len && midi[i] == expected[i]; i++) {
+        if (midi[i] == '\n') {
+            line_start = i + 1;
+            line++;
+        }
+    }
+    const char *e = expected + line_start, *g = midi + line_start;
+    printf("midi differs from %s at line %d\n", expect_path, line);
+    printf("  expected: %.*s\n", (int) strcspn(e, "\n"), e);
+    printf("  got:      %.*s\n", (int) strcspn(g, "\n"), g);
+    free(expected);
+    return 1;
+}
+
+int 
+replay_session(const char *path, const char *expect_path, const char *midi_path)
+{
+    /* Debug output would be timed along with the events and bury the 
+     * report. */
+    debug_enabled = 0;
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        perror(path);
+        return 1;
+    }
+    char *line = NULL;
+    size_t line_size = 0;
+    if (getline(&line, &line_size, in) < 0 || 
+        sscanf(line, "instances %d", &num_instances) != 1 ||
+        num_instances < 1 || num_instances > MAX_INSTANCES) {
+        fprintf(stderr, "%s: not a recorded session\n", path);
+        fclose(in);
+        return 1;
+    }
+    for (int n=0; n<num_instances; n++) {
+        init_instance(&instances[n]);
+    }
+
+    char *midi = NULL;
+    size_t midi_len = 0;
+    replay.out = open_memstream(&midi, &midi_len);
+    long events = 0;
+    int line_n = 1;
+    int status = 0;
+    while (getline(&line, &line_size, in) > 0) {
+        long long usec;
+        int n = 0;
+        line_n++;
+        line[strcspn(line, "\n")] = 0;
+        if (sscanf(line, "%lld %n", &usec, &n) != 1 || replay_event_at(usec, line+n)) {
+            fprintf(stderr, "%s:%d: can't replay \"%s\"\n", path, line_n, line);
+            status = 1;
+            break;
+        }
+        events++;
+    }
+    for (int i=0; i<REPLAY_TAIL; i++) {
+        run_cycle();
+    }
+    fclose(replay.out);
+    fclose(in);
+    free(line);
+
+    printf("%s: %ld events, %llu cycles, %ld midi events\n", path, events, 
+           (unsigned long long) replay.cycle, replay.midi_events);
+    for (int k=0; k<NUM_EVENT_KINDS; k++) {
+        print_cost(event_kinds[k], &replay.events[k]);
+    }
+    print_cost("midi cycle", &replay.midi_cycles);
+    print_cost("idle cycle", &replay.idle_cycles);
+
+    if (midi_path) {
+        FILE *out = fopen(midi_path, "w");
+        if (!out) {
+            perror(midi_path);
+            status = 1;
+        } else {
+            fwrite(midi, 1, midi_len, out);
+            fclose(out);
+        }
+    }
+    if (expect_path && compare_midi(expect_path, midi, midi_len)) {
+        status = 1;
+    }
+    free(midi);
+    return status;
+}
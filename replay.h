@@ -0,0 +1,51 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Replays and soak tests run as if under a JACK server at 48kHz with 256 
+ * frame periods. */
+#define REPLAY_RATE 48000
+#define REPLAY_PERIOD 256
+/* Room for every note on every channel to go off and back on in one cycle. */
+#define LOOPBACK_EVENTS (16*128*2)
+
+/* Stands in for a JACK midi port buffer, and keeps its rules: events in 
+ * time order, inside the period, and only so many of them. Events that 
+ * break them are counted in dropped. Reset count before each cycle. */
+struct loopback
+{
+    int count;
+    long dropped;
+    uint32_t time[LOOPBACK_EVENTS];
+    unsigned char data[LOOPBACK_EVENTS][3];
+};
+
+/* The reserve function of a midi_sink writing to a struct loopback. */
+unsigned char *loopback_reserve(void *buf, uint32_t time, size_t size);
+
+struct transport;
+/* Replays and soak tests play along with a transport rolling from frame 0, 
+ * at 120 quarter notes a minute. */
+void virtual_transport(struct transport *transport, uint64_t frame);
+
+/* Sessions are recorded as text, one user action per line: the time in 
+ * microseconds since recording started, then what happened, e.g.
+ *   1520332 press 97 38
+ *   1712004 click 4
+ * The first line is "instances N". */
+int record_open(const char *path);
+void record_close(void);
+void record_event(const char *format, ...);
+
+/* Play a recorded session through the engine in virtual time, headless, and
+ * print what each kind of event and each cycle cost. The midi produced is 
+ * written to midi_path, and compared with expect_path, if they're given. 
+ * Events land on the cycle their wall-clock time falls in, and the virtual
+ * transport isn't JACK's, so the midi can differ from what the live run 
+ * sent; expect_path has to be midi written by an earlier replay. 
+ * Returns nonzero if the session can't be read or the midi differs. */
+int replay_session(const char *path, const char *expect_path, const char *midi_path);
+
+#endif
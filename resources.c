@@ -112,7 +112,7 @@ static const SECTION union { const guint8 data[2458]; const double alignment; vo
   "\164\155\145\156\164\042\076\074\157\142\152\145\143\164\040\143"
   "\154\141\163\163\075\042\107\164\153\101\144\152\165\163\164\155"
   "\145\156\164\042\076\074\160\162\157\160\145\162\164\171\040\156"
-  "\141\155\145\075\042\154\157\167\145\162\042\076\060\074\057\160"
+  "\141\155\145\075\042\154\157\167\145\162\042\076\061\074\057\160"
   "\162\157\160\145\162\164\171\076\074\160\162\157\160\145\162\164"
   "\171\040\156\141\155\145\075\042\165\160\160\145\162\042\076\061"
   "\062\067\074\057\160\162\157\160\145\162\164\171\076\074\057\157"
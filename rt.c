@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <jack/jack.h>
+
+#include "engine.h"
+#include "cache.h"
+#include "telemetry.h"
+#include "netout.h"
+#include "rt.h"
+
+/* Stack process_cb may use, touched once in the process thread so its pages
+ * are there before the first cycle. */
+#define RT_STACK_PREFAULT (64*1024)
+
+static long faults_at_lock = -1;
+/* The cpus the process thread is to be pinned to, and the list they were
+ * given as; NULL if it isn't to be pinned. */
+static cpu_set_t cpus;
+static const char *cpus_given;
+
+/* Write every page of [start, start+size), so none of it is first touched,
+ * or still shared with the zero page, when process_cb gets there. Only
+ * safe before the process thread is running. */
+static void
+prefault(void *start, size_t size)
+{
+    volatile char *p = start;
+    long page = sysconf(_SC_PAGESIZE);
+    for (size_t i=0; i<size; i+=page) {
+        p[i] = p[i];
+    }
+    if (size) {
+        p[size-1] = p[size-1];
+    }
+}
+
+void
+rt_prefault(void)
+{
+    prefault(instances, sizeof(instances));
+    prefault(&telemetry, sizeof(telemetry));
+    if (netout.enabled) {
+        prefault(&netout, sizeof(netout));
+    }
+    for (int n=0; n<num_instances; n++) {
+        prefault(instances[n].cache, sizeof(struct cache_buffers));
+    }
+}
+
+/* Runs in the process thread before its first cycle. The array is touched
+ * from the far end, the way the stack grows into it. The thread starts
+ * after rt_lock_memory, so its stack is locked here. */
+void
+rt_thread_init(void *arg)
+{
+    volatile char stack[RT_STACK_PREFAULT];
+    long page = sysconf(_SC_PAGESIZE);
+    for (long i=RT_STACK_PREFAULT-1; i>=0; i-=page) {
+        stack[i] = 0;
+    }
+    stack[0] = stack[RT_STACK_PREFAULT-1];
+    if (faults_at_lock >= 0) {
+        mlock((const void *) stack, RT_STACK_PREFAULT);
+    }
+}
+
+static long
+major_faults(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage)) {
+        return -1;
+    }
+    return usage.ru_majflt;
+}
+
+/* Only what's mapped now: the RT buffers, libjack's and our code. GTK's
+ * heap comes later and stays out, so a low RLIMIT_MEMLOCK can't make its
+ * allocations fail. Call it before the client is activated. */
+void
+rt_lock_memory(void)
+{
+    if (mlockall(MCL_CURRENT)) {
+        fprintf(stderr, "lkey: cannot lock memory (%s); process_cb may page fault. "
+                "Raise the memlock limit, e.g. with @audio - memlock unlimited in "
+                "/etc/security/limits.conf.\n", strerror(errno));
+        return;
+    }
+    faults_at_lock = major_faults();
+}
+
+/* "2,3" or "0-1,4": returns 0 and fills set, or -1 if list doesn't parse. */
+static int
+parse_cpus(const char *list, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p) {
+            return -1;
+        }
+        p = end;
+        if (*p == '-') {
+            last = strtol(p+1, &end, 10);
+            if (end == p+1) {
+                return -1;
+            }
+            p = end;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu=first; cpu<=last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p) {
+            return -1;
+        }
+    }
+    return CPU_COUNT(set) ? 0 : -1;
+}
+
+int
+rt_set_cpus(const char *list)
+{
+    if (parse_cpus(list, &cpus)) {
+        fprintf(stderr, "lkey: bad cpu list \"%s\"\n", list);
+        return 1;
+    }
+    cpus_given = list;
+    return 0;
+}
+
+static const char *
+policy_name(int policy)
+{
+    switch (policy) {
+        case SCHED_FIFO: return "SCHED_FIFO";
+        case SCHED_RR: return "SCHED_RR";
+        case SCHED_OTHER: return "SCHED_OTHER";
+        case SCHED_BATCH: return "SCHED_BATCH";
+        case SCHED_IDLE: return "SCHED_IDLE";
+    }
+    return "unknown";
+}
+
+/* Pin the process thread if asked to, then report how it is scheduled.
+ * Returns 1 if the thread can't be pinned. */
+int
+rt_setup_thread(jack_client_t *client)
+{
+    pthread_t thread = jack_client_thread_id(client);
+    if (cpus_given) {
+        int err = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+        if (err) {
+            fprintf(stderr, "lkey: cannot pin the process thread to %s (%s)\n",
+                    cpus_given, strerror(err));
+            return 1;
+        }
+    }
+
+    int policy;
+    struct sched_param param;
+    int err = pthread_getschedparam(thread, &policy, &param);
+    if (err) {
+        fprintf(stderr, "lkey: cannot read the process thread's scheduling (%s)\n",
+                strerror(err));
+        return 0;
+    }
+    char pinned[64] = "";
+    cpu_set_t set;
+    if (pthread_getaffinity_np(thread, sizeof(set), &set) == 0 &&
+        CPU_COUNT(&set) < sysconf(_SC_NPROCESSORS_ONLN)) {
+        int used = snprintf(pinned, sizeof(pinned), ", on cpus");
+        for (int cpu=0; cpu<CPU_SETSIZE && used < (int) sizeof(pinned); cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                used += snprintf(pinned + used, sizeof(pinned) - used, " %d", cpu);
+            }
+        }
+    }
+    printf("lkey: process thread %s priority %d%s\n", policy_name(policy),
+           param.sched_priority, pinned);
+    if (policy != SCHED_FIFO && policy != SCHED_RR) {
+        fprintf(stderr, "lkey: the process thread isn't realtime%s; start jackd "
+                "with -R and check rtprio limits\n",
+                jack_is_realtime(client) ? " though JACK is" : "");
+    }
+    return 0;
+}
+
+void
+rt_report_faults(void)
+{
+    if (faults_at_lock >= 0) {
+        printf("lkey: %ld major page faults in the whole process (GTK included) "
+               "after memory was locked\n", major_faults() - faults_at_lock);
+    }
+}
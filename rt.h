@@ -0,0 +1,23 @@
+#ifndef __RT_H__
+#define __RT_H__
+
+#include <jack/jack.h>
+
+/* Keeping process_cb clear of page faults. Call rt_prefault and 
+ * rt_lock_memory before the JACK client is activated, pass rt_thread_init to
+ * jack_set_thread_init_callback, and call rt_setup_thread once it is. 
+ * rt_set_cpus, called before any of them, takes a list such as "2,3" or 
+ * "2-3" that rt_setup_thread then pins the process thread to; it returns 
+ * nonzero if the list doesn't parse, and rt_setup_thread if the thread
+ * can't be pinned. */
+int rt_set_cpus(const char *cpus);
+void rt_prefault(void);
+void rt_thread_init(void *arg);
+void rt_lock_memory(void);
+int rt_setup_thread(jack_client_t *client);
+/* At exit: how many major faults the whole process had after locking. 
+ * It's an upper bound for the process thread, which getrusage can't 
+ * single out. */
+void rt_report_faults(void);
+
+#endif
@@ -0,0 +1,252 @@
+#include <stdatomic.h>
+#include <gtk/gtk.h>
+
+#include "interface.h"
+#include "engine.h"
+#include "cache.h"
+#include "sequencer.h"
+
+/* Longest step the window offers, in beats. */
+#define MAX_STEP_BEATS 64
+
+static const char *slot_choices[NUM_CHORDS + 1] = {"1", "2", "3", "4", "5", "6",
+    "7", "8", "9", "10", NULL};
+
+static GtkWidget *sequencer_window;
+static GtkWidget *play_button;
+static GtkWidget *tempo_spin;
+static GtkWidget *step_rows[MAX_STEPS];
+static GtkWidget *chord_dropdowns[MAX_STEPS];
+static GtkWidget *inversion_spins[MAX_STEPS];
+static GtkWidget *beats_spins[MAX_STEPS];
+static int num_rows;
+static int shown_step = -1;
+/* Set while the widgets are being filled in, so their callbacks don't
+ * write the progression straight back. */
+static int refreshing;
+
+/* Send the visible rows to the engine as the progression. */
+static void
+progression_changed(void)
+{
+    struct progression_step steps[MAX_STEPS];
+    if (refreshing) {
+        return;
+    }
+    for (int i=0; i<num_rows; i++) {
+        steps[i].chord = gtk_drop_down_get_selected(GTK_DROP_DOWN(chord_dropdowns[i]));
+        steps[i].inversion = gtk_spin_button_get_value_as_int(
+            GTK_SPIN_BUTTON(inversion_spins[i]));
+        steps[i].beats = gtk_spin_button_get_value(GTK_SPIN_BUTTON(beats_spins[i]));
+    }
+    show_changes(engine_set_progression(steps, num_rows));
+}
+
+static void
+step_value_changed_cb(GtkSpinButton *spin, gpointer user_data)
+{
+    progression_changed();
+}
+
+static void
+step_chord_selected_cb(GObject *dropdown, GParamSpec *pspec, gpointer user_data)
+{
+    progression_changed();
+}
+
+static void
+show_rows(int n)
+{
+    num_rows = n;
+    for (int i=0; i<MAX_STEPS; i++) {
+        gtk_widget_set_visible(step_rows[i], i < num_rows);
+    }
+}
+
+/* A new step starts as a copy of the last one. */
+static void
+add_step_cb(GtkButton *button, gpointer user_data)
+{
+    if (num_rows == MAX_STEPS) {
+        return;
+    }
+    if (num_rows > 0) {
+        int last = num_rows - 1;
+        refreshing = 1;
+        gtk_drop_down_set_selected(GTK_DROP_DOWN(chord_dropdowns[num_rows]),
+            gtk_drop_down_get_selected(GTK_DROP_DOWN(chord_dropdowns[last])));
+        gtk_spin_button_set_value(GTK_SPIN_BUTTON(inversion_spins[num_rows]),
+            gtk_spin_button_get_value(GTK_SPIN_BUTTON(inversion_spins[last])));
+        gtk_spin_button_set_value(GTK_SPIN_BUTTON(beats_spins[num_rows]),
+            gtk_spin_button_get_value(GTK_SPIN_BUTTON(beats_spins[last])));
+        refreshing = 0;
+    }
+    show_rows(num_rows + 1);
+    progression_changed();
+}
+
+static void
+remove_step_cb(GtkButton *button, gpointer user_data)
+{
+    if (num_rows > 0) {
+        show_rows(num_rows - 1);
+        progression_changed();
+    }
+}
+
+static void
+transport_changed(void)
+{
+    if (refreshing) {
+        return;
+    }
+    int on = gtk_check_button_get_active(GTK_CHECK_BUTTON(play_button));
+    show_changes(engine_set_sequencer(on, 
+        gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(tempo_spin))));
+    if (!on) {
+        /* Keys pressed from now on play where the sequencer stopped. */
+        show_changes(engine_follow_sequencer());
+    }
+}
+
+static void
+play_toggled_cb(GtkCheckButton *button, gpointer user_data)
+{
+    transport_changed();
+}
+
+static void
+tempo_changed_cb(GtkSpinButton *spin, gpointer user_data)
+{
+    transport_changed();
+}
+
+static GtkWidget *
+step_row_new(int i)
+{
+    char number[8];
+    GtkWidget *row = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 10);
+    snprintf(number, sizeof(number), "%d", i+1);
+    gtk_box_append(GTK_BOX(row), gtk_label_new(number));
+
+    chord_dropdowns[i] = gtk_drop_down_new_from_strings(slot_choices);
+    gtk_widget_set_tooltip_text(chord_dropdowns[i], "Chord slot on the current page");
+    g_signal_connect(chord_dropdowns[i], "notify::selected",
+                     G_CALLBACK(step_chord_selected_cb), NULL);
+    gtk_box_append(GTK_BOX(row), chord_dropdowns[i]);
+
+    inversion_spins[i] = gtk_spin_button_new_with_range(-MAX_INVERSION, MAX_INVERSION, 1);
+    gtk_widget_set_tooltip_text(inversion_spins[i], "Inversion");
+    g_signal_connect(inversion_spins[i], "value-changed",
+                     G_CALLBACK(step_value_changed_cb), NULL);
+    gtk_box_append(GTK_BOX(row), inversion_spins[i]);
+
+    beats_spins[i] = gtk_spin_button_new_with_range(1.0 / STEP_QUARTERS, MAX_STEP_BEATS,
+                                                    1.0 / STEP_QUARTERS);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(beats_spins[i]), 4);
+    gtk_widget_set_tooltip_text(beats_spins[i], "Beats");
+    g_signal_connect(beats_spins[i], "value-changed",
+                     G_CALLBACK(step_value_changed_cb), NULL);
+    gtk_box_append(GTK_BOX(row), beats_spins[i]);
+    return row;
+}
+
+static void
+build_sequencer(GtkWindow *parent)
+{
+    sequencer_window = gtk_window_new();
+    gtk_window_set_title(GTK_WINDOW(sequencer_window), "Sequencer");
+    gtk_window_set_transient_for(GTK_WINDOW(sequencer_window), parent);
+    gtk_window_set_default_size(GTK_WINDOW(sequencer_window), 320, 400);
+    gtk_window_set_hide_on_close(GTK_WINDOW(sequencer_window), 1);
+
+    GtkWidget *box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+    gtk_widget_set_margin_top(box, 5);
+    gtk_widget_set_margin_bottom(box, 5);
+    gtk_widget_set_margin_start(box, 5);
+    gtk_widget_set_margin_end(box, 5);
+
+    GtkWidget *controls = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    play_button = gtk_check_button_new_with_label("Play");
+    gtk_widget_set_tooltip_text(play_button,
+        "Follows JACK transport while it rolls, otherwise runs at the tempo");
+    g_signal_connect(play_button, "toggled", G_CALLBACK(play_toggled_cb), NULL);
+    gtk_box_append(GTK_BOX(controls), play_button);
+    tempo_spin = gtk_spin_button_new_with_range(20, 300, 1);
+    gtk_widget_set_tooltip_text(tempo_spin, "Tempo, in beats per minute");
+    g_signal_connect(tempo_spin, "value-changed", G_CALLBACK(tempo_changed_cb), NULL);
+    gtk_box_append(GTK_BOX(controls), tempo_spin);
+    GtkWidget *add = gtk_button_new_with_label("Add step");
+    g_signal_connect(add, "clicked", G_CALLBACK(add_step_cb), NULL);
+    gtk_box_append(GTK_BOX(controls), add);
+    GtkWidget *remove = gtk_button_new_with_label("Remove step");
+    g_signal_connect(remove, "clicked", G_CALLBACK(remove_step_cb), NULL);
+    gtk_box_append(GTK_BOX(controls), remove);
+    gtk_box_append(GTK_BOX(box), controls);
+
+    GtkWidget *steps = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+    for (int i=0; i<MAX_STEPS; i++) {
+        step_rows[i] = step_row_new(i);
+        gtk_box_append(GTK_BOX(steps), step_rows[i]);
+    }
+    GtkWidget *scrolled = gtk_scrolled_window_new();
+    gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(scrolled), steps);
+    gtk_widget_set_vexpand(scrolled, 1);
+    gtk_box_append(GTK_BOX(box), scrolled);
+
+    gtk_window_set_child(GTK_WINDOW(sequencer_window), box);
+}
+
+void
+sequencer_refresh(void)
+{
+    if (!sequencer_window) {
+        return;
+    }
+    refreshing = 1;
+    gtk_check_button_set_active(GTK_CHECK_BUTTON(play_button),
+                                atomic_load(&active->sequencing));
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(tempo_spin), atomic_load(&active->seq_tempo));
+    /* The GTK thread is the progression's only writer, so it can read it
+     * without the seqlock. */
+    int n = atomic_load(&active->num_steps);
+    for (int i=0; i<n; i++) {
+        uint32_t packed = atomic_load(&active->progression[i]);
+        gtk_drop_down_set_selected(GTK_DROP_DOWN(chord_dropdowns[i]), packed & 0xff);
+        gtk_spin_button_set_value(GTK_SPIN_BUTTON(inversion_spins[i]), (int8_t) (packed >> 8));
+        gtk_spin_button_set_value(GTK_SPIN_BUTTON(beats_spins[i]),
+                                  (double) (packed >> 16) / STEP_QUARTERS);
+    }
+    show_rows(n);
+    refreshing = 0;
+}
+
+void
+sequencer_follow(void)
+{
+    show_changes(engine_follow_sequencer());
+    if (!sequencer_window) {
+        return;
+    }
+    int position = atomic_load_explicit(&active->seq_position, memory_order_relaxed);
+    int step = position < 0 ? -1 : position >> 8;
+    if (step != shown_step) {
+        if (shown_step >= 0) {
+            gtk_widget_remove_css_class(step_rows[shown_step], "highlighted");
+        }
+        if (step >= 0) {
+            gtk_widget_add_css_class(step_rows[step], "highlighted");
+        }
+        shown_step = step;
+    }
+}
+
+void
+sequencer_show(GtkWindow *parent)
+{
+    if (!sequencer_window) {
+        build_sequencer(parent);
+    }
+    sequencer_refresh();
+    gtk_window_present(GTK_WINDOW(sequencer_window));
+}
@@ -0,0 +1,13 @@
+#ifndef __SEQUENCER_H__
+#define __SEQUENCER_H__
+
+/* The sequencer window: the active instance's progression, one row per
+ * step, and the controls to start and stop it. */
+void sequencer_show(GtkWindow *parent);
+/* Show the active instance's progression, if the window has been opened. */
+void sequencer_refresh(void);
+/* Called every frame: moves the chord highlight, and the step highlight, to
+ * wherever process_cb's sequencers have got to. */
+void sequencer_follow(void);
+
+#endif
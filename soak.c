@@ -0,0 +1,388 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "replay.h"
+#include "netout.h"
+#include "soak.h"
+
+/* Storm events per second, seconds between progress reports, and how many
+ * of each kind of violation are printed in full. */
+#define SOAK_RATE 5000
+#define SOAK_REPORT 10
+#define MAX_REPORTED 10
+#define PERIOD_NSEC (1000000000LL * REPLAY_PERIOD / REPLAY_RATE)
+
+enum violation 
+{
+    V_BAD_MESSAGE, V_DOUBLE_ON, V_STRAY_OFF, V_DROPPED, V_STUCK, V_FLOOD, 
+    NUM_VIOLATIONS
+};
+static const char *violation_names[NUM_VIOLATIONS] = {"bad message", 
+    "note-on while on", "note-off while off", "event dropped", "stuck note",
+    "expression flood"};
+
+static _Atomic int storming;
+static _Atomic int cycling;
+static _Atomic long storm_events;
+static _Atomic long cycles;
+static _Atomic long midi_events;
+static _Atomic long violations[NUM_VIOLATIONS];
+static struct timespec soak_start;
+
+/* Only touched by the cycle thread: the ports, and the notes each has on
+ * per channel. */
+static struct loopback ports[MAX_INSTANCES];
+static noteset_t port_notes[MAX_INSTANCES][16];
+
+/* Only touched by the storm thread, and by soak_run once it has stopped. */
+static uint8_t held[NUM_KEYS];
+static int sustain_down;
+static unsigned seed;
+
+static void
+advance(struct timespec *t, long long nsec)
+{
+    nsec += t->tv_nsec;
+    t->tv_sec += nsec / 1000000000;
+    t->tv_nsec = nsec % 1000000000;
+}
+
+static double
+seconds_since_start(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - soak_start.tv_sec) + (now.tv_nsec - soak_start.tv_nsec)/1e9;
+}
+
+static void
+violation(enum violation v, const char *format, ...)
+{
+    if (atomic_fetch_add(&violations[v], 1) >= MAX_REPORTED) {
+        return;
+    }
+    printf("soak: %.3fs: %s: ", seconds_since_start(), violation_names[v]);
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    putchar('\n');
+}
+
+/* THE CYCLE THREAD */
+
+/* Bend, CC1, CC11 and channel pressure: fine as long as no more than 
+ * EXPRESSION_STEPS of one kind go to one channel in a cycle. expression 
+ * counts them, per kind and channel. */
+static void
+check_expression(int n, const unsigned char *data, int expression[4][16])
+{
+    int status = data[0] & 0xf0;
+    int kind = status == 0xe0 ? 0 : (status == 0xd0 ? 1 : (data[1] == 1 ? 2 : 3));
+    if ((status == 0xb0 && data[1] != 1 && data[1] != 11) || data[1] > 127 || 
+        data[2] > 127 || (status == 0xd0 && data[2])) {
+        violation(V_BAD_MESSAGE, "port %d: %02x %02x %02x", n+1, data[0], 
+                  data[1], data[2]);
+    } else if (++expression[kind][data[0] & 0x0f] == EXPRESSION_STEPS + 1) {
+        violation(V_FLOOD, "port %d: %02x", n+1, data[0]);
+    }
+}
+
+/* Check what port n got this cycle against the notes it had on. */
+static void
+check_port(int n)
+{
+    struct loopback *port = &ports[n];
+    int expression[4][16] = {{0}};
+    for (int i=0; i<port->count; i++) {
+        unsigned char *data = port->data[i];
+        int status = data[0] & 0xf0;
+        int note = data[1];
+        noteset_t *notes = &port_notes[n][data[0] & 0x0f];
+        if (status == 0xb0 || status == 0xd0 || status == 0xe0) {
+            check_expression(n, data, expression);
+        } else if ((status != 0x80 && status != 0x90) || note > 127 || data[2] > 127) {
+            violation(V_BAD_MESSAGE, "port %d: %02x %02x %02x", n+1, data[0], 
+                      data[1], data[2]);
+        } else if (status == 0x90) {
+            if (noteset_has(notes, note)) {
+                violation(V_DOUBLE_ON, "port %d channel %d: note %d", n+1, 
+                          (data[0] & 0x0f) + 1, note);
+            }
+            noteset_add(notes, note);
+        } else {
+            if (!noteset_has(notes, note)) {
+                violation(V_STRAY_OFF, "port %d channel %d: note %d", n+1, 
+                          (data[0] & 0x0f) + 1, note);
+            }
+            noteset_remove(notes, note);
+        }
+    }
+    if (port->dropped) {
+        violation(V_DROPPED, "port %d: %ld events", n+1, port->dropped);
+        port->dropped = 0;
+    }
+    atomic_fetch_add(&midi_events, port->count);
+}
+
+/* Stands in for process_cb, on the same schedule a JACK server would keep. */
+static void *
+cycle_thread(void *arg)
+{
+    struct timespec next;
+    struct transport transport;
+    uint64_t frame = 0;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (atomic_load(&cycling)) {
+        virtual_transport(&transport, frame);
+        for (int n=0; n<num_instances; n++) {
+            struct midi_sink sink = { loopback_reserve, &ports[n] };
+            ports[n].count = 0;
+            process_instance(&instances[n], &sink, REPLAY_PERIOD, &transport);
+            check_port(n);
+            for (int i=0; i<ports[n].count; i++) {
+                netout_publish(&netout, ports[n].time[i], n, ports[n].data[i]);
+            }
+        }
+        netout_commit(&netout, frame);
+        frame += REPLAY_PERIOD;
+        atomic_fetch_add(&cycles, 1);
+        advance(&next, PERIOD_NSEC);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    return NULL;
+}
+
+/* THE STORM THREAD */
+
+static void
+tap(unsigned keyval, unsigned keycode)
+{
+    engine_key_pressed(keyval, keycode);
+    engine_key_released(keyval, keycode);
+}
+
+/* Move a random zone somewhere random, with keys held through it. */
+static void
+storm_zone(void)
+{
+    int low = rand_r(&seed) % NUM_KEYS;
+    int high = rand_r(&seed) % NUM_KEYS;
+    if (low > high) {
+        int t = low; low = high; high = t;
+    }
+    engine_set_zone(rand_r(&seed) % MAX_ZONES, rand_r(&seed) % 4 != 0, low, high, 
+                    rand_r(&seed) % (NUM_CHORDS + 1) - 1, rand_r(&seed) % 5 - 2,
+                    rand_r(&seed) % 2 ? rand_r(&seed) % 128 : 0, rand_r(&seed) % 4);
+}
+
+/* A random progression, or starting or stopping the sequencer. */
+static void
+storm_sequencer(void)
+{
+    if (rand_r(&seed) % 2) {
+        struct progression_step steps[4];
+        int num_steps = 1 + rand_r(&seed) % 4;
+        for (int i=0; i<num_steps; i++) {
+            steps[i].chord = rand_r(&seed) % NUM_CHORDS;
+            steps[i].inversion = rand_r(&seed) % 3 - 1;
+            steps[i].beats = (1 + rand_r(&seed) % 8) / 4.0;
+        }
+        engine_set_progression(steps, num_steps);
+    } else {
+        engine_set_sequencer(rand_r(&seed) % 2, 60 + rand_r(&seed) % 120);
+        engine_follow_sequencer();
+    }
+}
+
+/* One random thing a user could do. Mostly notes, with chord switches, 
+ * inversions, octaves, pedal, latch, harmony, quantization, zones, the 
+ * sequencer and chord editing mixed in. */
+static void
+storm_event(void)
+{
+    static const unsigned arrows[4] = {111, 113, 114, 116};
+    int r = rand_r(&seed) % 1000;
+    if (editing == 2) {
+        /* A few names, so the library's indexes reach a steady state. */
+        char name[16];
+        snprintf(name, sizeof(name), "Soak %d", r % 10);
+        engine_name_chord(name);
+    } else if (r < 10) {
+        /* A burst of pointer motion, many moves to a cycle. */
+        if (rand_r(&seed) % 10 == 0) {
+            engine_set_vertical(rand_r(&seed) % 3, rand_r(&seed) % 2);
+        }
+        for (int moves=rand_r(&seed) % 20; moves>=0; moves--) {
+            engine_set_expression(rand_r(&seed) % 0x4000, rand_r(&seed) % 128);
+        }
+    } else if (r < 700) {
+        int pkey = rand_r(&seed) % NUM_KEYS;
+        if (held[pkey]) {
+            engine_key_released(0, note_keycodes[pkey]);
+        } else {
+            engine_key_pressed(0, note_keycodes[pkey]);
+        }
+        held[pkey] = !held[pkey];
+    } else if (r < 780) {
+        int n = rand_r(&seed) % 10;
+        tap('0' + n, n ? 9 + n : 19);
+    } else if (r < 820) {
+        tap(0, arrows[rand_r(&seed) % 4]);
+    } else if (r < 825) {
+        /* Turn the page, sometimes onto a new one. */
+        engine_show_page(rand_r(&seed) % (active->num_pages + 1));
+    } else if (r < 860) {
+        tap(0, rand_r(&seed) % 2 ? 34 : 35);
+    } else if (r < 890) {
+        tap(0, rand_r(&seed) % 2 ? 20 : 21);
+    } else if (r < 920) {
+        if (sustain_down) {
+            engine_key_released(0, 65);
+        } else {
+            engine_key_pressed(0, 65);
+        }
+        sustain_down = !sustain_down;
+    } else if (r < 935) {
+        tap(0, 23);
+    } else if (r < 950) {
+        engine_set_live(rand_r(&seed) % 2);
+    } else if (r < 955) {
+        engine_set_harmony(rand_r(&seed) % 3, rand_r(&seed) % 12, rand_r(&seed) % 7);
+    } else if (r < 960) {
+        engine_set_quantize(rand_r(&seed) % 5, 50 + rand_r(&seed) % 26);
+    } else if (r < 963) {
+        storm_zone();
+    } else if (r < 965) {
+        storm_sequencer();
+    } else if (r < 970) {
+        tap(0, 67 + rand_r(&seed) % num_instances);
+    } else if (r < 975) {
+        tap(0, 9);
+    } else if (r < 985) {
+        if (!editing) {
+            engine_edit_chord(rand_r(&seed) % NUM_CHORDS);
+        }
+    } else if (editing == 1) {
+        tap(0, 36);
+    }
+}
+
+static void *
+storm_thread(void *arg)
+{
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (atomic_load(&storming)) {
+        storm_event();
+        atomic_fetch_add(&storm_events, 1);
+        advance(&next, 1000000000 / SOAK_RATE);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    return NULL;
+}
+
+/* Let go of everything, the way a user lifting their hands would, so all 
+ * notes should go off. */
+static void
+let_go(void)
+{
+    for (int pkey=0; pkey<NUM_KEYS; pkey++) {
+        if (held[pkey]) {
+            engine_key_released(0, note_keycodes[pkey]);
+            held[pkey] = 0;
+        }
+    }
+    if (sustain_down) {
+        engine_key_released(0, 65);
+        sustain_down = 0;
+    }
+    if (editing == 1) {
+        tap(0, 36);
+    }
+    if (editing == 2) {
+        engine_name_chord("Soak");
+    }
+    for (int n=0; n<num_instances; n++) {
+        engine_switch_instance(n);
+        engine_set_latch(0);
+    }
+}
+
+static long
+total_violations(void)
+{
+    long total = 0;
+    for (int v=0; v<NUM_VIOLATIONS; v++) {
+        total += atomic_load(&violations[v]);
+    }
+    return total;
+}
+
+static void
+report(double elapsed)
+{
+    long events = atomic_load(&storm_events);
+    printf("soak: %6.0fs  %ld events (%.0f/s)  %ld cycles  %ld midi events  "
+           "%ld violations\n", elapsed, events, events/elapsed, 
+           atomic_load(&cycles), atomic_load(&midi_events), total_violations());
+    fflush(stdout);
+}
+
+int 
+soak_run(int seconds)
+{
+    pthread_t cycler, stormer;
+    seed = time(NULL);
+    /* The storms would bury the report in debug output. */
+    debug_enabled = 0;
+    printf("soak: %d seconds, %d instances, %d events/s, seed %u\n", seconds,
+           num_instances, SOAK_RATE, seed);
+    clock_gettime(CLOCK_MONOTONIC, &soak_start);
+    atomic_store(&cycling, 1);
+    atomic_store(&storming, 1);
+    pthread_create(&cycler, NULL, cycle_thread, NULL);
+    pthread_create(&stormer, NULL, storm_thread, NULL);
+
+    double elapsed;
+    while ((elapsed = seconds_since_start()) < seconds) {
+        double left = seconds - elapsed;
+        usleep(1000000 * (left < SOAK_REPORT ? left : SOAK_REPORT));
+        report(seconds_since_start());
+    }
+    atomic_store(&storming, 0);
+    pthread_join(stormer, NULL);
+
+    let_go();
+    /* A second of cycles, to send the note-offs and anything still waiting
+     * for its grid line. */
+    long until = atomic_load(&cycles) + REPLAY_RATE / REPLAY_PERIOD;
+    while (atomic_load(&cycles) < until) {
+        usleep(PERIOD_NSEC / 1000);
+    }
+    atomic_store(&cycling, 0);
+    pthread_join(cycler, NULL);
+
+    for (int n=0; n<num_instances; n++) {
+        for (int channel=0; channel<16; channel++) {
+            noteset_t stuck = port_notes[n][channel];
+            int note;
+            while ((note = noteset_pop(&stuck)) >= 0) {
+                violation(V_STUCK, "port %d channel %d: note %d", n+1, channel+1, note);
+            }
+        }
+    }
+    report(seconds_since_start());
+    for (int v=0; v<NUM_VIOLATIONS; v++) {
+        if (atomic_load(&violations[v])) {
+            printf("  %-20s %ld\n", violation_names[v], atomic_load(&violations[v]));
+        }
+    }
+    return total_violations() != 0;
+}
@@ -0,0 +1,11 @@
+#ifndef __SOAK_H__
+#define __SOAK_H__
+
+/* Hammer the engine with random key storms from one thread while another 
+ * runs process cycles against loopback ports, for the given number of 
+ * seconds. Every midi event is checked as it comes out, and the notes still
+ * on once everything has been let go are reported as stuck. Returns nonzero
+ * if anything was wrong. */
+int soak_run(int seconds);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef __TABLES_H__
+#define __TABLES_H__
+
+#include <stdint.h>
+
+/* Church modes, starting from Ionian. */
+#define NUM_MODES 7
+
+/* A chord as intervals above the pressed note. */
+struct diatonic_chord
+{
+    int8_t len;
+    int8_t intervals[4];
+};
+
+/* Indexed by [sevenths][key root][mode][pitch class of the pressed note]. 
+ * Notes outside the scale play alone. Generated at build time by gentables.c. */
+extern const struct diatonic_chord diatonic_chords[2][12][NUM_MODES][12];
+
+/* Chord quality suffixes, such as "m7" or "7#9"; the major triad is "". */
+#define NO_QUALITY 255
+extern const char *const chord_qualities[];
+
+/* How a set of pitch classes (bit n for pitch class n, C being 0) reads as
+ * a chord: its best root and quality, root being -1 if no quality fits, and
+ * the quality it has with C as the root, or NO_QUALITY. Indexed by the set.
+ * Generated at build time by gentables.c. */
+struct pitch_class_set_name
+{
+    int8_t root;
+    uint8_t quality;
+    uint8_t quality_on_c;
+};
+extern const struct pitch_class_set_name pitch_class_set_names[4096];
+
+#endif
@@ -0,0 +1,72 @@
+#include <stdatomic.h>
+
+#include "telemetry.h"
+
+#define TELEMETRY_MASK (TELEMETRY_SIZE - 1)
+
+struct telemetry telemetry;
+
+static uint64_t
+pack_event(uint32_t time, int port, const unsigned char *data)
+{
+    return (uint64_t) time << 32 | (uint64_t) port << 24 | 
+        (uint64_t) data[0] << 16 | (uint64_t) data[1] << 8 | data[2];
+}
+
+static void
+unpack_event(uint64_t packed, struct telemetry_event *event)
+{
+    event->time = packed >> 32;
+    event->port = packed >> 24;
+    event->data[0] = packed >> 16;
+    event->data[1] = packed >> 8;
+    event->data[2] = packed;
+}
+
+void 
+telemetry_publish(struct telemetry *t, uint32_t time, int port, 
+                  const unsigned char *data)
+{
+    struct telemetry_slot *slot = &t->slots[t->written & TELEMETRY_MASK];
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&slot->event, pack_event(time, port, data), 
+                          memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, t->written + 1, memory_order_release);
+    t->written++;
+}
+
+void 
+telemetry_commit(struct telemetry *t, uint32_t now)
+{
+    atomic_store_explicit(&t->now, now, memory_order_relaxed);
+    atomic_store_explicit(&t->head, t->written, memory_order_release);
+}
+
+int 
+telemetry_read(struct telemetry *t, struct telemetry_event *event)
+{
+    uint64_t head = atomic_load_explicit(&t->head, memory_order_acquire);
+    while (t->read < head) {
+        /* Whatever the writer has lapped is gone. */
+        if (head - t->read > TELEMETRY_SIZE) {
+            t->dropped += head - TELEMETRY_SIZE - t->read;
+            t->read = head - TELEMETRY_SIZE;
+        }
+        struct telemetry_slot *slot = &t->slots[t->read & TELEMETRY_MASK];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        uint64_t packed = atomic_load_explicit(&slot->event, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        int intact = seq == t->read + 1 && 
+            atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq;
+        t->read++;
+        if (intact) {
+            unpack_event(packed, event);
+            return 1;
+        }
+        /* Overwritten while we looked: catch up with the writer. */
+        t->dropped++;
+        head = atomic_load_explicit(&t->head, memory_order_acquire);
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+#include <stdint.h>
+
+/* Slots in the ring; a power of two. At 3 bytes per event that's more midi
+ * than one JACK period can hold, so only a stalled UI loses any. */
+#define TELEMETRY_SIZE 4096
+
+/* One midi event that went out: its absolute frame time, the instance it
+ * came from, and the message. */
+struct telemetry_event
+{
+    uint32_t time;
+    uint8_t port;
+    uint8_t data[3];
+};
+
+/* Each slot is a tiny seqlock: seq is cleared while the event is being 
+ * replaced, then set to the event's position + 1. */
+struct telemetry_slot
+{
+    _Atomic uint64_t seq;
+    _Atomic uint64_t event;
+};
+
+/* The midi process_cb sends, passed on to the UI. There is one writer, 
+ * process_cb, which never waits or even looks at the reader: when the ring
+ * is full it simply writes over the oldest events. The reader, the UI, 
+ * notices and counts what it missed. */
+struct telemetry
+{
+    struct telemetry_slot slots[TELEMETRY_SIZE];
+    /* Published by process_cb once per cycle: events written so far, and 
+     * the frame time the cycle ends at. */
+    _Atomic uint64_t head;
+    _Atomic uint32_t now;
+    uint32_t rate;
+    /* process_cb's own copy of head. */
+    uint64_t written;
+    /* Only touched by the reader. */
+    uint64_t read;
+    long dropped;
+};
+extern struct telemetry telemetry;
+
+/* process_cb: add one event, then publish the cycle's events at its end. */
+void telemetry_publish(struct telemetry *t, uint32_t time, int port, 
+                       const unsigned char *data);
+void telemetry_commit(struct telemetry *t, uint32_t now);
+/* UI: take the next event. Returns 0 when there are none left. */
+int telemetry_read(struct telemetry *t, struct telemetry_event *event);
+
+#endif
@@ -0,0 +1,142 @@
+#include <gtk/gtk.h>
+
+#include "interface.h"
+#include "engine.h"
+#include "zones.h"
+
+enum zone_column { COL_ENABLED, COL_LOW, COL_HIGH, COL_CHORD, COL_OCTAVE,
+    COL_VELOCITY, COL_CHANNEL, NUM_COLUMNS };
+
+static const char *column_names[NUM_COLUMNS] = {"", "From key", "To key",
+    "Chord", "Octave", "Velocity", "Channel"};
+static const char *chord_choices[NUM_CHORDS + 2] = {"Current", "1", "2", "3",
+    "4", "5", "6", "7", "8", "9", "10", NULL};
+
+static GtkWidget *zones_window;
+static GtkWidget *zone_widgets[MAX_ZONES][NUM_COLUMNS];
+/* Set while the widgets are being filled in, so their callbacks don't
+ * write the zones straight back. */
+static int refreshing;
+
+/* Send row z to the engine. Keys and channels are shown counting from 1. */
+static void
+zone_changed(int z)
+{
+    GtkWidget **row = zone_widgets[z];
+    if (refreshing) {
+        return;
+    }
+    int low = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(row[COL_LOW])) - 1;
+    int high = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(row[COL_HIGH])) - 1;
+    if (low > high) {
+        int t = low; low = high; high = t;
+    }
+    show_changes(engine_set_zone(z,
+        gtk_check_button_get_active(GTK_CHECK_BUTTON(row[COL_ENABLED])), low, high,
+        (int) gtk_drop_down_get_selected(GTK_DROP_DOWN(row[COL_CHORD])) - 1,
+        gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(row[COL_OCTAVE])),
+        gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(row[COL_VELOCITY])),
+        gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(row[COL_CHANNEL])) - 1));
+}
+
+static void
+toggled_cb(GtkCheckButton *button, gpointer user_data)
+{
+    zone_changed(GPOINTER_TO_INT(user_data));
+}
+
+static void
+value_changed_cb(GtkSpinButton *spin, gpointer user_data)
+{
+    zone_changed(GPOINTER_TO_INT(user_data));
+}
+
+static void
+chord_selected_cb(GObject *dropdown, GParamSpec *pspec, gpointer user_data)
+{
+    zone_changed(GPOINTER_TO_INT(user_data));
+}
+
+static GtkWidget *
+zone_spin_new(int z, int min, int max)
+{
+    GtkWidget *spin = gtk_spin_button_new_with_range(min, max, 1);
+    g_signal_connect(spin, "value-changed", G_CALLBACK(value_changed_cb),
+                     GINT_TO_POINTER(z));
+    return spin;
+}
+
+static void
+build_zones(GtkWindow *parent)
+{
+    zones_window = gtk_window_new();
+    gtk_window_set_title(GTK_WINDOW(zones_window), "Zones");
+    gtk_window_set_transient_for(GTK_WINDOW(zones_window), parent);
+    gtk_window_set_hide_on_close(GTK_WINDOW(zones_window), 1);
+
+    GtkWidget *grid = gtk_grid_new();
+    gtk_grid_set_row_spacing(GTK_GRID(grid), 5);
+    gtk_grid_set_column_spacing(GTK_GRID(grid), 10);
+    gtk_widget_set_margin_top(grid, 5);
+    gtk_widget_set_margin_bottom(grid, 5);
+    gtk_widget_set_margin_start(grid, 5);
+    gtk_widget_set_margin_end(grid, 5);
+    for (int c=0; c<NUM_COLUMNS; c++) {
+        gtk_grid_attach(GTK_GRID(grid), gtk_label_new(column_names[c]), c, 0, 1, 1);
+    }
+    for (int z=0; z<MAX_ZONES; z++) {
+        GtkWidget **row = zone_widgets[z];
+        char name[16];
+        snprintf(name, sizeof(name), "Zone %d", z+1);
+        row[COL_ENABLED] = gtk_check_button_new_with_label(name);
+        g_signal_connect(row[COL_ENABLED], "toggled", G_CALLBACK(toggled_cb),
+                         GINT_TO_POINTER(z));
+        row[COL_LOW] = zone_spin_new(z, 1, NUM_KEYS);
+        row[COL_HIGH] = zone_spin_new(z, 1, NUM_KEYS);
+        row[COL_CHORD] = gtk_drop_down_new_from_strings(chord_choices);
+        gtk_widget_set_tooltip_text(row[COL_CHORD],
+            "The chord the zone plays: the current one, or always the same slot "
+            "of the current page");
+        g_signal_connect(row[COL_CHORD], "notify::selected",
+                         G_CALLBACK(chord_selected_cb), GINT_TO_POINTER(z));
+        row[COL_OCTAVE] = zone_spin_new(z, -MAX_ZONE_OCTAVE, MAX_ZONE_OCTAVE);
+        row[COL_VELOCITY] = zone_spin_new(z, 0, 127);
+        gtk_widget_set_tooltip_text(row[COL_VELOCITY], "0 follows the velocity slider");
+        row[COL_CHANNEL] = zone_spin_new(z, 1, 16);
+        for (int c=0; c<NUM_COLUMNS; c++) {
+            gtk_grid_attach(GTK_GRID(grid), row[c], c, z+1, 1, 1);
+        }
+    }
+    gtk_window_set_child(GTK_WINDOW(zones_window), grid);
+}
+
+void
+zones_refresh(void)
+{
+    if (!zones_window) {
+        return;
+    }
+    refreshing = 1;
+    for (int z=0; z<MAX_ZONES; z++) {
+        const struct zone *zone = &active->zones[z];
+        GtkWidget **row = zone_widgets[z];
+        gtk_check_button_set_active(GTK_CHECK_BUTTON(row[COL_ENABLED]), zone->enabled);
+        gtk_spin_button_set_value(GTK_SPIN_BUTTON(row[COL_LOW]), zone->low + 1);
+        gtk_spin_button_set_value(GTK_SPIN_BUTTON(row[COL_HIGH]), zone->high + 1);
+        gtk_drop_down_set_selected(GTK_DROP_DOWN(row[COL_CHORD]), zone->chord + 1);
+        gtk_spin_button_set_value(GTK_SPIN_BUTTON(row[COL_OCTAVE]), zone->octave);
+        gtk_spin_button_set_value(GTK_SPIN_BUTTON(row[COL_VELOCITY]), zone->velocity);
+        gtk_spin_button_set_value(GTK_SPIN_BUTTON(row[COL_CHANNEL]), zone->channel + 1);
+    }
+    refreshing = 0;
+}
+
+void
+zones_show(GtkWindow *parent)
+{
+    if (!zones_window) {
+        build_zones(parent);
+    }
+    zones_refresh();
+    gtk_window_present(GTK_WINDOW(zones_window));
+}
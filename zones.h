@@ -0,0 +1,10 @@
+#ifndef __ZONES_H__
+#define __ZONES_H__
+
+/* The zones window: one row per zone, with the keys it covers and what they
+ * play. Zones that overlap are layered. */
+void zones_show(GtkWindow *parent);
+/* Show the active instance's zones, if the window has been opened. */
+void zones_refresh(void);
+
+#endif